@@ -0,0 +1,523 @@
+#pragma once
+
+// Sample sort across processes: the keys are split into one range per rank, every rank sends each of
+// the others the keys in its range, then each rank sorts what it got with a RadixSort::Sorter.
+// Ranks talk through a Transport; SocketTransport and ShmTransport are for several processes on
+// one Linux host. Linux only.
+
+#ifndef __linux__
+#error "DistributedSort.h needs Linux (Unix domain sockets, POSIX shared memory)"
+#endif
+
+#include "RadixSort.h"
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+namespace RadixSort
+{
+
+//####################################################################################################
+// Transports
+
+// How ranks reach each other. Messages from one rank to another arrive in order, and send()/recv()
+// move exactly bytes, blocking as long as they need to. One thread may send while another receives,
+// but two threads must not send (or receive) at once.
+class Transport
+{
+public:
+	virtual ~Transport() {}
+	virtual int rank() const = 0;
+	virtual int size() const = 0;
+	virtual void send(int to, const void* data, size_t bytes) = 0;
+	virtual void recv(int from, void* data, size_t bytes) = 0;
+
+protected:
+	static void fail(const std::string& what) { throw std::runtime_error(what + ": " + strerror(errno)); }
+};
+
+// One Unix domain stream socket per pair of ranks. Every rank passes the same dir, which must be
+// writable; rank r listens on dir/radix-r.sock until all the higher ranks have connected.
+class SocketTransport : public Transport
+{
+public:
+	SocketTransport(const std::string& dir, int rank, int size, int timeoutSeconds = 30) : me(rank), n(size), peers(size, -1)
+	{
+		std::string path = socketPath(dir, rank);
+		int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0) fail("socket()");
+		unlink(path.c_str());
+		sockaddr_un addr = address(path);
+		if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, size) != 0) fail("can't listen on " + path);
+
+		// Connect down, accept up. The first message on each connection is the connecting rank.
+		auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSeconds);
+		for (int p = 0; p < rank; p++)
+		{
+			sockaddr_un peer = address(socketPath(dir, p));
+			int fd;
+			for (;;)
+			{
+				fd = socket(AF_UNIX, SOCK_STREAM, 0);
+				if (fd < 0) fail("socket()");
+				if (connect(fd, (sockaddr*)&peer, sizeof(peer)) == 0) break;
+				// Not there yet, or a leftover socket file from an earlier run
+				int err = errno;
+				close(fd);
+				errno = err;
+				if ((err != ENOENT && err != ECONNREFUSED) || std::chrono::steady_clock::now() > giveUp) fail("can't connect to rank " + std::to_string(p));
+				usleep(1000);
+			}
+			int32_t hello = rank;
+			writeAll(fd, &hello, sizeof(hello));
+			peers[p] = fd;
+		}
+		for (int i = rank + 1; i < size; i++)
+		{
+			int fd = accept(listener, nullptr, nullptr);
+			if (fd < 0) fail("accept()");
+			int32_t hello = -1;
+			readAll(fd, &hello, sizeof(hello));
+			if (hello <= rank || hello >= size || peers[hello] >= 0) throw std::runtime_error("SocketTransport: unexpected hello from a peer");
+			peers[hello] = fd;
+		}
+		close(listener);
+		unlink(path.c_str());
+	}
+	~SocketTransport()
+	{
+		for (int fd : peers) { if (fd >= 0) close(fd); }
+	}
+	SocketTransport(const SocketTransport&) = delete;
+	SocketTransport& operator=(const SocketTransport&) = delete;
+
+	int rank() const override { return me; }
+	int size() const override { return n; }
+	void send(int to, const void* data, size_t bytes) override { writeAll(peers[to], data, bytes); }
+	void recv(int from, void* data, size_t bytes) override { readAll(peers[from], data, bytes); }
+
+private:
+	int me, n;
+	std::vector<int> peers;
+
+	static std::string socketPath(const std::string& dir, int rank) { return dir + "/radix-" + std::to_string(rank) + ".sock"; }
+	static sockaddr_un address(const std::string& path)
+	{
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path)) throw std::length_error("SocketTransport: socket path too long: " + path);
+		memcpy(addr.sun_path, path.c_str(), path.size());
+		return addr;
+	}
+	static void writeAll(int fd, const void* data, size_t bytes)
+	{
+		const char* p = (const char*)data;
+		while (bytes > 0)
+		{
+			ssize_t done = ::send(fd, p, bytes, MSG_NOSIGNAL);
+			if (done < 0) { if (errno == EINTR) continue; fail("send()"); }
+			p += done;
+			bytes -= (size_t)done;
+		}
+	}
+	static void readAll(int fd, void* data, size_t bytes)
+	{
+		char* p = (char*)data;
+		while (bytes > 0)
+		{
+			ssize_t done = ::read(fd, p, bytes);
+			if (done < 0) { if (errno == EINTR) continue; fail("read()"); }
+			if (done == 0) throw std::runtime_error("SocketTransport: peer hung up");
+			p += done;
+			bytes -= (size_t)done;
+		}
+	}
+}; // class SocketTransport
+
+// One single producer, single consumer ring buffer in POSIX shared memory for each ordered pair of ranks.
+// Every rank passes the same name, like "/radix-job42". Rank 0 creates it, and the name is removed
+// again as soon as every rank has attached, so nothing is left behind. Waiting spins, then yields.
+class ShmTransport : public Transport
+{
+public:
+	ShmTransport(const std::string& name, int rank, int size, size_t ringBytes = 1 << 18, int timeoutSeconds = 30)
+		: me(rank), n(size), ringSize((ringBytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE), stride(sizeof(Ring) + ringSize)
+	{
+		mapBytes = sizeof(Header) + stride * (size_t)size * size;
+		auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSeconds);
+		int fd;
+		if (rank == 0)
+		{
+			fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+			if (fd < 0) fail("can't create " + name + " (left over from a crashed run?)");
+			if (ftruncate(fd, (off_t)mapBytes) != 0) fail("ftruncate()");
+		}
+		else
+		{
+			// Wait for rank 0 to create it and size it. New pages are zero, which is an empty ring.
+			struct stat st;
+			while ((fd = shm_open(name.c_str(), O_RDWR, 0600)) < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size != mapBytes)
+			{
+				if (fd >= 0) close(fd);
+				if (std::chrono::steady_clock::now() > giveUp) fail("can't open " + name);
+				usleep(1000);
+			}
+		}
+		void* p = mmap(nullptr, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) fail("mmap()");
+		base = (char*)p;
+		header()->attached.fetch_add(1);
+		if (rank == 0)
+		{
+			while (header()->attached.load() < (unsigned)size)
+			{
+				if (std::chrono::steady_clock::now() > giveUp) { shm_unlink(name.c_str()); throw std::runtime_error("ShmTransport: not every rank attached"); }
+				usleep(1000);
+			}
+			shm_unlink(name.c_str());
+		}
+	}
+	~ShmTransport() { munmap(base, mapBytes); }
+	ShmTransport(const ShmTransport&) = delete;
+	ShmTransport& operator=(const ShmTransport&) = delete;
+
+	int rank() const override { return me; }
+	int size() const override { return n; }
+
+	void send(int to, const void* data, size_t bytes) override
+	{
+		Ring* r = ring(me, to);
+		const char* p = (const char*)data;
+		uint64_t head = r->head.load(std::memory_order_relaxed);
+		for (int spins = 0; bytes > 0; )
+		{
+			size_t space = ringSize - (size_t)(head - r->tail.load(std::memory_order_acquire));
+			if (space == 0) { wait(spins); continue; }
+			spins = 0;
+			size_t at = (size_t)(head % ringSize);
+			size_t chunk = std::min(std::min(space, bytes), ringSize - at);
+			memcpy(r->data() + at, p, chunk);
+			head += chunk;
+			r->head.store(head, std::memory_order_release);
+			p += chunk;
+			bytes -= chunk;
+		}
+	}
+
+	void recv(int from, void* data, size_t bytes) override
+	{
+		Ring* r = ring(from, me);
+		char* p = (char*)data;
+		uint64_t tail = r->tail.load(std::memory_order_relaxed);
+		for (int spins = 0; bytes > 0; )
+		{
+			size_t avail = (size_t)(r->head.load(std::memory_order_acquire) - tail);
+			if (avail == 0) { wait(spins); continue; }
+			spins = 0;
+			size_t at = (size_t)(tail % ringSize);
+			size_t chunk = std::min(std::min(avail, bytes), ringSize - at);
+			memcpy(p, r->data() + at, chunk);
+			tail += chunk;
+			r->tail.store(tail, std::memory_order_release);
+			p += chunk;
+			bytes -= chunk;
+		}
+	}
+
+private:
+	struct Header
+	{
+		std::atomic<unsigned> attached;
+		char pad[CACHE_LINE_SIZE - sizeof(std::atomic<unsigned>)];
+	};
+	// Producer and consumer each get a cache line of their own. The data follows the struct.
+	struct Ring
+	{
+		std::atomic<uint64_t> head; // total bytes written
+		char pad0[CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>)];
+		std::atomic<uint64_t> tail; // total bytes read
+		char pad1[CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>)];
+		char* data() { return (char*)(this + 1); }
+	};
+	int me, n;
+	size_t ringSize, stride, mapBytes;
+	char* base;
+
+	Header* header() { return (Header*)base; }
+	Ring* ring(int from, int to) { return (Ring*)(base + sizeof(Header) + stride * ((size_t)from * n + to)); }
+	static void wait(int& spins)
+	{
+		if (++spins < 1000) return;
+		if (spins < 2000) sched_yield();
+		else usleep(50);
+	}
+}; // class ShmTransport
+
+
+//####################################################################################################
+// Collectives
+
+// Every rank sends sendBytes[p] bytes at send[p] to each rank p, itself included, and receives
+// recvBytes[p] bytes from each p into recv[p]. Sends go from a second thread, so two ranks sending
+// each other more than the transport can buffer don't deadlock.
+inline void allToAll(Transport& t, const std::vector<const char*>& send, const std::vector<size_t>& sendBytes,
+	const std::vector<char*>& recv, const std::vector<size_t>& recvBytes)
+{
+	int me = t.rank(), n = t.size();
+	if (sendBytes[me]) memcpy(recv[me], send[me], sendBytes[me]);
+	std::exception_ptr sendError;
+	std::thread sender([&]
+	{
+		try { for (int i = 1; i < n; i++) { int to = (me + i) % n; t.send(to, send[to], sendBytes[to]); } }
+		catch (...) { sendError = std::current_exception(); }
+	});
+	std::exception_ptr recvError;
+	try { for (int i = 1; i < n; i++) { int from = (me - i + n) % n; t.recv(from, recv[from], recvBytes[from]); } }
+	catch (...) { recvError = std::current_exception(); }
+	sender.join();
+	if (recvError) std::rethrow_exception(recvError);
+	if (sendError) std::rethrow_exception(sendError);
+}
+
+// Everyone's value of x, in rank order
+template <typename V>
+std::vector<V> allGather(Transport& t, const V& x)
+{
+	std::vector<V> all(t.size());
+	std::vector<const char*> send(t.size(), (const char*)&x);
+	std::vector<size_t> bytes(t.size(), sizeof(V));
+	std::vector<char*> recv(t.size());
+	for (int p = 0; p < t.size(); p++) recv[p] = (char*)&all[p];
+	allToAll(t, send, bytes, recv, bytes);
+	return all;
+}
+
+// Everyone's items, one after another in rank order
+template <typename V>
+std::vector<V> allGatherV(Transport& t, const V* items, size_t count)
+{
+	std::vector<uint64_t> counts = allGather(t, (uint64_t)count);
+	size_t total = 0;
+	for (uint64_t c : counts) total += (size_t)c;
+	std::vector<V> all(total);
+	std::vector<const char*> send(t.size(), (const char*)items);
+	std::vector<size_t> sendBytes(t.size(), count * sizeof(V)), recvBytes(t.size());
+	std::vector<char*> recv(t.size());
+	size_t at = 0;
+	for (int p = 0; p < t.size(); p++)
+	{
+		recv[p] = (char*)(all.data() + at);
+		recvBytes[p] = (size_t)counts[p] * sizeof(V);
+		at += (size_t)counts[p];
+	}
+	allToAll(t, send, sendBytes, recv, recvBytes);
+	return all;
+}
+
+
+//####################################################################################################
+// The sort
+
+enum class Splitters
+{
+	Sample,   // a random sample from every rank, sorted; the splitters are evenly spaced in it
+	Histogram // counts of the top 16 bits of the key on every rank, added up and cut into equal parts
+};
+
+struct DistributedTimings
+{
+	double sample = 0;    // picking the splitters
+	double exchange = 0;  // partitioning and sending every key to its rank
+	double localSort = 0; // Sorter::sort() on what arrived
+	size_t sent = 0, received = 0; // elements that went to or came from other ranks
+};
+
+// Sorts the keys of all ranks together. Every rank calls it at the same time, with the same settings.
+// Afterwards data holds this rank's shard: every key in it comes after the keys on lower ranks and
+// before those on higher ranks, in sort() order. Elements go over the transport as raw bytes, so T
+// must be trivially copyable. Many copies of one key all end up on one rank, so heavily duplicated
+// keys unbalance the shards, and so does Splitters::Histogram with keys that mostly share their top 16 bits.
+template <class S, typename T>
+void distributedSort(Transport& t, S& local, std::vector<T>& data, Splitters how = Splitters::Sample,
+	DistributedTimings* timings = nullptr, size_t oversample = 64)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "distributedSort() sends elements as bytes, T must be trivially copyable");
+	typedef std::chrono::steady_clock clk;
+	auto seconds = [](clk::time_point since) { return std::chrono::duration<double>(clk::now() - since).count(); };
+	int me = t.rank(), n = t.size();
+	size_t count = data.size();
+	DistributedTimings time;
+
+	// Which rank each element goes to
+	auto beg = clk::now();
+	std::vector<uint32_t> dest(count);
+	if (how == Splitters::Sample)
+	{
+		size_t want = std::min(count, oversample * (size_t)n);
+		std::vector<T> sample;
+		sample.reserve(want);
+		unsigned long long x = 88172645463325252ull ^ (unsigned long long)(me + 1);
+		for (size_t i = 0; i < want; i++)
+		{
+			x ^= x << 13; x ^= x >> 7; x ^= x << 17; // xorshift
+			sample.push_back(data[(size_t)(x % count)]);
+		}
+		std::vector<T> all = allGatherV(t, sample.data(), sample.size());
+		local.sort(all.data(), all.size(), true);
+		std::vector<T> splitters;
+		for (int r = 1; r < n && !all.empty(); r++) splitters.push_back(all[all.size() * r / n]);
+		for (size_t i = 0; i < count; i++)
+		{
+			// The first splitter that comes after data[i] is the rank's upper end
+			size_t lo = 0, hi = splitters.size();
+			while (lo < hi)
+			{
+				size_t mid = (lo + hi) / 2;
+				if (local.comesBefore(data[i], splitters[mid])) hi = mid;
+				else lo = mid + 1;
+			}
+			dest[i] = (uint32_t)lo;
+		}
+	}
+	else
+	{
+		const size_t numBins = 0x10000;
+		auto bin = [&](const T& v) { return ((size_t)local.orderedByte(v, 0) << 8) | local.orderedByte(v, 1); };
+		std::vector<uint64_t> hist(numBins, 0);
+		for (size_t i = 0; i < count; i++) hist[bin(data[i])]++;
+		std::vector<uint64_t> all = allGatherV(t, hist.data(), numBins);
+		for (size_t b = 0; b < numBins; b++)
+		{
+			hist[b] = 0;
+			for (int r = 0; r < n; r++) hist[b] += all[r * numBins + b];
+		}
+		uint64_t total = 0;
+		for (uint64_t h : hist) total += h;
+		// A bin goes to the rank its first key would land on if the shards were exactly equal
+		std::vector<uint32_t> binRank(numBins);
+		uint64_t before = 0;
+		for (size_t b = 0; b < numBins; b++)
+		{
+			binRank[b] = total ? (uint32_t)std::min<uint64_t>(n - 1, before * n / total) : 0;
+			before += hist[b];
+		}
+		for (size_t i = 0; i < count; i++) dest[i] = binRank[bin(data[i])];
+	}
+	time.sample = seconds(beg);
+
+	// Group by destination, then swap counts, then the elements themselves
+	beg = clk::now();
+	std::vector<size_t> sendCount(n, 0);
+	for (size_t i = 0; i < count; i++) sendCount[dest[i]]++;
+	std::vector<size_t> at(n, 0);
+	for (int r = 1; r < n; r++) at[r] = at[r - 1] + sendCount[r - 1];
+	std::vector<T> grouped(count);
+	for (size_t i = 0; i < count; i++) grouped[at[dest[i]]++] = data[i];
+	std::vector<uint64_t> recvCount(n);
+	{
+		std::vector<const char*> send(n);
+		std::vector<char*> recv(n);
+		std::vector<size_t> bytes(n, sizeof(uint64_t));
+		std::vector<uint64_t> sendCount64(sendCount.begin(), sendCount.end());
+		for (int r = 0; r < n; r++) { send[r] = (const char*)&sendCount64[r]; recv[r] = (char*)&recvCount[r]; }
+		allToAll(t, send, bytes, recv, bytes);
+	}
+	size_t received = 0;
+	for (uint64_t c : recvCount) received += (size_t)c;
+	std::vector<T> mine(received);
+	{
+		std::vector<const char*> send(n);
+		std::vector<char*> recv(n);
+		std::vector<size_t> sendBytes(n), recvBytes(n);
+		size_t sendAt = 0, recvAt = 0;
+		for (int r = 0; r < n; r++)
+		{
+			send[r] = (const char*)(grouped.data() + sendAt);
+			sendBytes[r] = sendCount[r] * sizeof(T);
+			sendAt += sendCount[r];
+			recv[r] = (char*)(mine.data() + recvAt);
+			recvBytes[r] = (size_t)recvCount[r] * sizeof(T);
+			recvAt += (size_t)recvCount[r];
+		}
+		allToAll(t, send, sendBytes, recv, recvBytes);
+	}
+	time.sent = count - sendCount[me];
+	time.received = received - (size_t)recvCount[me];
+	std::vector<T>().swap(grouped);
+	std::vector<uint32_t>().swap(dest);
+	time.exchange = seconds(beg);
+
+	beg = clk::now();
+	local.sort(mine.data(), mine.size());
+	data.swap(mine);
+	time.localSort = seconds(beg);
+	if (timings) *timings = time;
+}
+
+// True on every rank if every shard is sorted and no key on a rank comes before a key on a lower rank.
+// Each rank hands the last key so far to the next, so this takes one hop per rank.
+template <class S, typename T>
+bool checkGlobalOrder(Transport& t, S& local, const std::vector<T>& data)
+{
+	int me = t.rank(), n = t.size();
+	bool ok = true;
+	for (size_t i = 1; i < data.size() && ok; i++) ok = !local.comesBefore(data[i], data[i - 1]);
+	struct Last { uint32_t has; T key; } last;
+	memset(&last, 0, sizeof(last));
+	if (me > 0)
+	{
+		t.recv(me - 1, &last, sizeof(last));
+		if (last.has && !data.empty() && local.comesBefore(data.front(), last.key)) ok = false;
+	}
+	if (!data.empty()) { last.has = 1; last.key = data.back(); }
+	if (me + 1 < n) t.send(me + 1, &last, sizeof(last));
+	for (char good : allGather(t, (char)ok)) ok = ok && good;
+	return ok;
+}
+
+// Runs fn(rank) in numRanks processes forked from this one, for trying a distributed sort on one
+// machine. Returns true if every rank returned 0. Fork before starting any threads in this process.
+inline bool forkRanks(int numRanks, const std::function<int(int)>& fn)
+{
+	std::cout.flush();
+	std::vector<pid_t> pids;
+	bool ok = true;
+	for (int r = 0; r < numRanks; r++)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			int rc = 1;
+			try { rc = fn(r); }
+			catch (std::exception& e) { std::cerr << "rank " << r << ": " << e.what() << "\n"; }
+			std::cout.flush();
+			std::cerr.flush();
+			_exit(rc);
+		}
+		if (pid < 0) { ok = false; break; }
+		pids.push_back(pid);
+	}
+	for (pid_t pid : pids)
+	{
+		int status = 0;
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+	}
+	return ok;
+}
+
+} //namespace RadixSort
@@ -1,12 +1,58 @@
+#pragma once
 
 #include <string>
+#include <cstring>
 #include <stdexcept>
 #include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstdlib>
 
 #ifndef RADIX_SORT_NO_MMINTRIN // #define this if you get errors about _mm_prefetch or this header
-#include <mmintrin.h>
+#include <xmmintrin.h>
+// T0 = we'll need this again soon, keep it in every cache level.
+// Named hint, because MSVC and GCC number them differently.
+#define RADIX_SORT_PREFETCH(addr) ::_mm_prefetch((const char*)(addr), _MM_HINT_T0)
+#else
+#define RADIX_SORT_PREFETCH(addr) ((void)0)
 #endif
 #define CACHE_LINE_SIZE 64
+#ifndef RADIX_SORT_WRITE_COMBINE_BITS // partition() uses write-combining buffers from this many bits up
+#define RADIX_SORT_WRITE_COMBINE_BITS 8
+#endif
+
+#ifndef RADIX_SORT_NO_THREADS // #define this to leave out ThreadPool and the parallel sort
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <deque>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#endif
+
+#ifdef RADIX_SORT_PERF_COUNTERS // #define this (Linux only) for PerfRecorder, hardware counters per sort phase
+#ifndef __linux__
+#error "RADIX_SORT_PERF_COUNTERS needs Linux perf_event_open()"
+#endif
+#include <ostream>
+#include <iomanip>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 
 #ifndef RADIX_SORT_32_BIT
@@ -28,12 +74,32 @@ typedef int mint;
 typedef unsigned int umint;
 #endif
 
+#if defined(_MSC_VER) && defined(_WIN64)
+#include <intrin.h>
+#endif
+
 namespace RadixSort
 {
 
+// Index of the lowest set bit, x != 0
+inline int lowestBit(unsigned long long x)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#elif defined(_MSC_VER) && defined(_WIN64)
+	unsigned long i;
+	_BitScanForward64(&i, x);
+	return (int)i;
+#else
+	int i = 0;
+	while ((x & 1) == 0) { x >>= 1; i++; }
+	return i;
+#endif
+}
+
 template<typename T>
-class GetSizeIntrinsic { public: int operator()(T x) { return sizeof(T); }};
-class GetSizeString { public: int operator()(std::string s) { return (int)s.size(); }};
+class GetSizeIntrinsic { public: int operator()(const T& x) { return sizeof(T); }};
+class GetSizeString { public: int operator()(const std::string& s) { return (int)s.size(); }};
 
 // Note: Indexer classes must accept indeces greater than length of item and return a valid byte, usually 0 in such a case.
 template <typename T>
@@ -77,14 +143,14 @@ class IndexIntrinsic { public: inline unsigned char operator()(const T& x, int i
 class IndexString{ public: inline unsigned char operator()(const std::string& s, int i){ return (i < s.size()) ? s[i] : 0; } };
 
 // Pair prefabs
-template <typename T = int> struct GetSizeIntPair { constexpr size_t operator(T x)() { return sizeof(T); } };
+template <typename T = int> struct GetSizeIntPair { constexpr size_t operator()(const std::pair<T, size_t>& /*x*/) const { return sizeof(T); } };
 struct GetSizeFloatPair { constexpr size_t operator()(const std::pair<float, size_t>& x) { return sizeof(float); } };
 struct GetSizeDoublePair { constexpr size_t operator()(const std::pair<double, size_t>& x) { return sizeof(double); } };
 struct GetSizeStringPair { inline size_t operator()(const std::pair<std::string, size_t>& x) { return x.first.size(); } };
 template <typename T = int> struct IndexIntPair
 {
 	IndexInt<T> ind;
-	inline unsigned char operator()(std::pair<T, size_t> p, int byte)
+	inline unsigned char operator()(const std::pair<T, size_t>& p, int byte)
 	{
 		static_assert(std::is_integral<T>::value, "Template argument to IndexIntPair must be an integer type");
 		return ind(p.first, byte);
@@ -103,10 +169,552 @@ struct IndexDoublePair
 struct IndexStringPair
 {
 	IndexString ind;
-	inline unsigned char operator()(const std::pair<std::string, size_t>& x, int i) { return x.first[i]; }
+	inline unsigned char operator()(const std::pair<std::string, size_t>& x, int i) { return ind(x.first, i); }
+};
+
+
+
+
+// Lets another thread stop a sort between passes. Copies share the same flag.
+// A Sorter that sees it set puts the (unsorted) data back in the caller's array and throws SortCancelled.
+class CancelToken
+{
+public:
+	CancelToken() : flag(std::make_shared<std::atomic<bool>>(false)) {}
+	void cancel() { flag->store(true, std::memory_order_relaxed); }
+	bool cancelled() const { return flag->load(std::memory_order_relaxed); }
+	const std::shared_ptr<std::atomic<bool>>& state() const { return flag; }
+private:
+	std::shared_ptr<std::atomic<bool>> flag;
+};
+
+class SortCancelled : public std::runtime_error
+{
+public:
+	SortCancelled() : std::runtime_error("Radix sort was cancelled.") {}
+};
+
+#ifndef RADIX_SORT_NO_THREADS
+//####################################################################################################
+// A few long lived threads that run posted jobs in order. Meant as an executor for
+// sortAsync()/viewAsync(), but any executor callable with a std::function<void()> will do.
+class WorkQueue
+{
+public:
+	WorkQueue(unsigned numThreads = 1)
+	{
+		stopping = false;
+		if (numThreads == 0) numThreads = 1;
+		for (unsigned i = 0; i < numThreads; i++) threads.emplace_back(&WorkQueue::loop, this);
+	}
+	// Finishes everything already posted before returning.
+	~WorkQueue()
+	{
+		{
+			std::lock_guard<std::mutex> lk(m);
+			stopping = true;
+		}
+		cv.notify_all();
+		for (auto& t : threads) t.join();
+	}
+	WorkQueue(const WorkQueue&) = delete;
+	WorkQueue& operator=(const WorkQueue&) = delete;
+
+	void post(std::function<void()> job)
+	{
+		{
+			std::lock_guard<std::mutex> lk(m);
+			jobs.push_back(std::move(job));
+		}
+		cv.notify_one();
+	}
+	void operator()(std::function<void()> job) { post(std::move(job)); }
+
+private:
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()>> jobs;
+	std::mutex m;
+	std::condition_variable cv;
+	bool stopping;
+
+	void loop()
+	{
+		for (;;)
+		{
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lk(m);
+				cv.wait(lk, [this] { return stopping || !jobs.empty(); });
+				if (jobs.empty()) return;
+				job = std::move(jobs.front());
+				jobs.pop_front();
+			}
+			job();
+		}
+	}
+}; // class WorkQueue
+
+// Default executor for sortAsync()/viewAsync(): a fresh thread per request.
+struct NewThreadExecutor
+{
+	void operator()(std::function<void()> job) { std::thread(std::move(job)).detach(); }
+};
+
+//####################################################################################################
+// Persistent worker threads for the parallel sort paths.
+// Make one and share it between as many Sorters as you like (setThreadPool()), or let a Sorter
+// own one (useThreads()). Threads are started once and sleep between jobs, so sorting over and over
+// doesn't pay for thread creation every call.
+// Workers are pinned to cores in NUMA node order, so task t always runs on the same core and
+// neighbouring tasks share a node. The parallel sort gives task t the same slice of the array on
+// every pass, which keeps each slice on the node that touched it first.
+class ThreadPool
+{
+public:
+	// numThreads = 0 means one per hardware thread. Task 0 of every job runs on the calling thread,
+	// so this starts numThreads - 1 workers.
+	ThreadPool(unsigned numThreads = 0, bool pinThreads = true)
+	{
+		if (numThreads == 0) numThreads = std::thread::hardware_concurrency();
+		if (numThreads == 0) numThreads = 1;
+		nThreads = numThreads;
+		generation = 0;
+		pending = 0;
+		stopping = false;
+		jobTasks = 0;
+		jobFn = nullptr;
+		jobCtx = nullptr;
+		buildCpuOrder();
+		for (unsigned w = 1; w < nThreads; w++)
+		{
+			workers.emplace_back(&ThreadPool::workerLoop, this, w);
+			if (pinThreads) pin(workers.back(), cpuOrder[w % cpuOrder.size()]);
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lk(m);
+			stopping = true;
+		}
+		cvWork.notify_all();
+		for (auto& t : workers) t.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned size() const { return nThreads; }
+	// NUMA node that task t runs on. Task 0 is the caller, which isn't pinned, so it's a best guess.
+	int nodeOf(unsigned t) const { return cpuNode[t % cpuNode.size()]; }
+
+	// Calls fn(t) for every t in [0, numTasks) and returns once all of them are done.
+	// numTasks must not exceed size(). Jobs from different callers take turns.
+	// Don't call run() from inside a task on the same pool; that deadlocks.
+	template <class F>
+	void run(unsigned numTasks, F& fn)
+	{
+		if (numTasks > nThreads) throw std::invalid_argument("ThreadPool::run(): more tasks than threads");
+		std::lock_guard<std::mutex> runLk(runLock);
+		if (numTasks <= 1)
+		{
+			if (numTasks == 1) fn(0);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lk(m);
+			jobFn = &thunk<F>;
+			jobCtx = &fn;
+			jobTasks = numTasks;
+			jobError = nullptr;
+			pending = nThreads - 1;
+			generation++;
+		}
+		cvWork.notify_all();
+		runTask(0);
+
+		// Short spin first, most jobs here are only a few hundred microseconds long.
+		for (int spin = 0; spin < 4096 && pending.load(std::memory_order_acquire) != 0; spin++) std::this_thread::yield();
+		if (pending.load(std::memory_order_acquire) != 0)
+		{
+			std::unique_lock<std::mutex> lk(m);
+			cvDone.wait(lk, [this] { return pending.load() == 0; });
+		}
+		if (jobError) std::rethrow_exception(jobError);
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::vector<int> cpuOrder, cpuNode;
+	unsigned nThreads;
+	std::mutex m, runLock;
+	std::condition_variable cvWork, cvDone;
+	unsigned long long generation;
+	std::atomic<unsigned> pending;
+	bool stopping;
+	unsigned jobTasks;
+	void (*jobFn)(void*, unsigned);
+	void* jobCtx;
+	std::exception_ptr jobError;
+
+	template <class F> static void thunk(void* ctx, unsigned t) { (*static_cast<F*>(ctx))(t); }
+
+	void runTask(unsigned t)
+	{
+		if (t >= jobTasks) return;
+		try { jobFn(jobCtx, t); }
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lk(m);
+			if (!jobError) jobError = std::current_exception();
+		}
+	}
+
+	void workerLoop(unsigned w)
+	{
+		unsigned long long seen = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lk(m);
+				cvWork.wait(lk, [&] { return stopping || generation != seen; });
+				if (stopping) return;
+				seen = generation;
+			}
+			runTask(w);
+			if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				std::lock_guard<std::mutex> lk(m);
+				cvDone.notify_one();
+			}
+		}
+	}
+
+	// Lists the cpus we're allowed to run on, grouped by NUMA node.
+	void buildCpuOrder()
+	{
+#ifdef __linux__
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) { for (int c = 0; c < CPU_SETSIZE; c++) CPU_SET(c, &allowed); }
+		bool seen[CPU_SETSIZE] = {};
+		for (int node = 0; node < 1024; node++)
+		{
+			std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			if (!f) continue;
+			std::string list;
+			std::getline(f, list);
+			// Format is like "0-7,16-23"
+			size_t pos = 0;
+			while (pos < list.size())
+			{
+				size_t end = list.find(',', pos);
+				if (end == std::string::npos) end = list.size();
+				std::string range = list.substr(pos, end - pos);
+				size_t dash = range.find('-');
+				int lo = std::atoi(range.c_str());
+				int hi = (dash == std::string::npos) ? lo : std::atoi(range.c_str() + dash + 1);
+				for (int c = lo; c <= hi && c < CPU_SETSIZE; c++)
+				{
+					if (c >= 0 && CPU_ISSET(c, &allowed) && !seen[c])
+					{
+						seen[c] = true;
+						cpuOrder.push_back(c);
+						cpuNode.push_back(node);
+					}
+				}
+				pos = end + 1;
+			}
+		}
+		for (int c = 0; c < CPU_SETSIZE; c++)
+		{
+			// No sysfs (or cpus it didn't mention), call it node 0.
+			if (CPU_ISSET(c, &allowed) && !seen[c]) { cpuOrder.push_back(c); cpuNode.push_back(0); }
+		}
+#endif
+		if (cpuOrder.empty())
+		{
+			unsigned hw = std::thread::hardware_concurrency();
+			for (unsigned c = 0; c < (hw ? hw : 1); c++) { cpuOrder.push_back((int)c); cpuNode.push_back(0); }
+		}
+	}
+
+	static void pin(std::thread& t, int cpu)
+	{
+#if defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#elif defined(_WIN32) && defined(_WINDOWS_)
+		// Only if you've already included Windows.h, this header doesn't drag it in.
+		if (cpu < (int)(sizeof(DWORD_PTR) * 8)) SetThreadAffinityMask(t.native_handle(), (DWORD_PTR)1 << cpu);
+#else
+		(void)t; (void)cpu;
+#endif
+	}
+}; // class ThreadPool
+#endif // RADIX_SORT_NO_THREADS
+
+
+//####################################################################################################
+// Tuning profiles
+
+// The settings Sorter picks per call. The defaults are what Sorter uses without a profile.
+struct Tuning
+{
+	size_t smallSortThreshold = 32;     // insertion sort below this many elements
+	size_t parallelThreshold = 0x10000; // use the thread pool from this many elements
+	unsigned threads = 0;               // tasks per parallel pass, 0 = the whole pool
+	size_t prefetchBytes = 0x8000;      // re-prefetch the bucket offsets every this many bytes of input, 0 = never
+	bool keepMemory = false;            // keep scratch memory between calls, as if keepMemoryResources were always set
+	size_t indirectBytes = 128;         // sort() moves elements at least this big through (key, index) tags, 0 = never
+};
+
+// Which Tuning to use for each element type and array size. Sorter::calibrate() measures one on
+// the current machine, save() and load() keep it in a small text file, and fixed() is just the
+// defaults, for runs that have to be reproducible. Each line of the file looks like
+//     f4 65536 small=32 parallel=65536 threads=0 prefetch=32768 keep=1 indirect=128
+// which is the type (see Sorter::profileKey(), * = any type), the smallest array size the line
+// applies to, then the settings. Settings left off a line keep their defaults.
+class Profile
+{
+public:
+	struct Entry
+	{
+		std::string type;
+		size_t minSize;
+		Tuning tuning;
+	};
+	std::vector<Entry> entries;
+
+	static Profile fixed()
+	{
+		Profile p;
+		p.set("*", 0, Tuning());
+		return p;
+	}
+
+	// Adds an entry, or replaces the one with the same type and minSize
+	void set(const std::string& type, size_t minSize, const Tuning& tuning)
+	{
+		for (auto& e : entries)
+		{
+			if (e.type == type && e.minSize == minSize) { e.tuning = tuning; return; }
+		}
+		entries.push_back(Entry{ type, minSize, tuning });
+	}
+
+	// Entries for type sorted by minSize, or the "*" ones if type has none
+	std::vector<Entry> entriesFor(const std::string& type) const
+	{
+		std::vector<Entry> found;
+		for (auto& e : entries) { if (e.type == type) found.push_back(e); }
+		if (found.empty()) { for (auto& e : entries) { if (e.type == "*") found.push_back(e); } }
+		std::sort(found.begin(), found.end(), [](const Entry& a, const Entry& b) { return a.minSize < b.minSize; });
+		return found;
+	}
+
+	bool save(const std::string& path) const
+	{
+		std::ofstream out(path);
+		if (!out) return false;
+		out << "# RadixSort profile: type minSize settings...\n";
+		for (auto& e : entries)
+		{
+			const Tuning& t = e.tuning;
+			out << e.type << " " << e.minSize << " small=" << t.smallSortThreshold << " parallel=" << t.parallelThreshold
+				<< " threads=" << t.threads << " prefetch=" << t.prefetchBytes << " keep=" << (t.keepMemory ? 1 : 0)
+				<< " indirect=" << t.indirectBytes << "\n";
+		}
+		return (bool)out;
+	}
+
+	// Adds the entries from a file. Returns false if it can't be read; lines it doesn't understand are skipped.
+	bool load(const std::string& path)
+	{
+		std::ifstream in(path);
+		if (!in) return false;
+		std::string line;
+		while (std::getline(in, line))
+		{
+			std::istringstream words(line);
+			Entry e;
+			if (!(words >> e.type >> e.minSize) || e.type[0] == '#') continue;
+			std::string word;
+			while (words >> word)
+			{
+				size_t eq = word.find('=');
+				if (eq == std::string::npos) continue;
+				std::string name = word.substr(0, eq);
+				unsigned long long v = strtoull(word.c_str() + eq + 1, nullptr, 10);
+				if (name == "small") e.tuning.smallSortThreshold = (size_t)v;
+				else if (name == "parallel") e.tuning.parallelThreshold = (size_t)v;
+				else if (name == "threads") e.tuning.threads = (unsigned)v;
+				else if (name == "prefetch") e.tuning.prefetchBytes = (size_t)v;
+				else if (name == "keep") e.tuning.keepMemory = (v != 0);
+				else if (name == "indirect") e.tuning.indirectBytes = (size_t)v;
+			}
+			set(e.type, e.minSize, e.tuning);
+		}
+		return true;
+	}
+
+	// The profile named by the RADIX_SORT_PROFILE environment variable, a file path or "fixed",
+	// read once. nullptr if it's not set or can't be read. New Sorters start out with it.
+	static const Profile* global()
+	{
+		static Profile profile;
+		static bool loaded = loadGlobal(profile);
+		return loaded ? &profile : nullptr;
+	}
+
+private:
+	static bool loadGlobal(Profile& profile)
+	{
+		const char* name = getenv("RADIX_SORT_PROFILE");
+		if (!name || !*name) return false;
+		if (std::string(name) == "fixed") { profile = fixed(); return true; }
+		return profile.load(name);
+	}
+}; // class Profile
+
+
+#ifdef RADIX_SORT_PERF_COUNTERS
+//####################################################################################################
+// Hardware counters
+
+// Counts hardware events for the thread that created it, in user space only, with perf_event_open().
+// Events that the CPU, the VM or perf_event_paranoid won't give us stay at 0; available() says which worked.
+class PerfCounters
+{
+public:
+	enum Event { Cycles, Instructions, L1DMisses, LLCMisses, DTLBMisses, NumEvents };
+	static const char* name(int e)
+	{
+		static const char* names[NumEvents] = { "cycles", "instr", "L1D miss", "LLC miss", "dTLB miss" };
+		return names[e];
+	}
+
+	PerfCounters()
+	{
+		const unsigned long long readMiss = PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+		fd[Cycles] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+		fd[Instructions] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+		fd[L1DMisses] = open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | readMiss);
+		fd[LLCMisses] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+		fd[DTLBMisses] = open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | readMiss);
+	}
+	~PerfCounters()
+	{
+		for (int e = 0; e < NumEvents; e++) { if (fd[e] >= 0) close(fd[e]); }
+	}
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	bool available(int e) const { return fd[e] >= 0; }
+
+	// Totals since the counters were opened
+	void read(uint64_t out[NumEvents]) const
+	{
+		for (int e = 0; e < NumEvents; e++)
+		{
+			out[e] = 0;
+			if (fd[e] >= 0 && ::read(fd[e], &out[e], sizeof(uint64_t)) != sizeof(uint64_t)) out[e] = 0;
+		}
+	}
+
+private:
+	int fd[NumEvents];
+
+	static int open(unsigned type, unsigned long long config)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+}; // class PerfCounters
+
+// The counts for one phase of a sort. pass is the byte of the radix pass, or -1 for phases that aren't one.
+struct PerfSample
+{
+	const char* phase;
+	int pass;
+	uint64_t counts[PerfCounters::NumEvents];
 };
 
+// Give one to a Sorter with setPerfRecorder() and it splits every sort() and view() into phases:
+// key sizes, then histogram and scatter for each pass, negatives, copy back. Samples of the same
+// phase and pass add up, so sorting many arrays gives totals per pass. Counters only see the thread
+// that created the recorder, so sort on that thread; with a thread pool that's task 0's share.
+class PerfRecorder
+{
+public:
+	std::vector<PerfSample> samples; // in the order each phase was first seen
+	PerfCounters counters;
+
+	PerfRecorder() : curPhase(nullptr), curPass(-1) {}
+
+	// Ends the current phase and starts the next one. nullptr just ends it.
+	void mark(const char* phase, int pass = -1)
+	{
+		uint64_t now[PerfCounters::NumEvents];
+		counters.read(now);
+		if (curPhase)
+		{
+			PerfSample* s = find(curPhase, curPass);
+			for (int e = 0; e < PerfCounters::NumEvents; e++) s->counts[e] += now[e] - start[e];
+		}
+		curPhase = phase;
+		curPass = pass;
+		memcpy(start, now, sizeof(start));
+	}
+
+	void clear() { samples.clear(); curPhase = nullptr; }
+
+	void print(std::ostream& out) const
+	{
+		// Put the caller's formatting back afterwards
+		std::ios_base::fmtflags flags = out.flags();
+		std::streamsize precision = out.precision();
+		out << std::left << std::setw(16) << "phase" << std::setw(6) << "pass";
+		for (int e = 0; e < PerfCounters::NumEvents; e++) out << std::right << std::setw(14) << (counters.available(e) ? PerfCounters::name(e) : "n/a");
+		out << std::setw(8) << "IPC" << "\n";
+		for (auto& s : samples)
+		{
+			out << std::left << std::setw(16) << s.phase << std::setw(6);
+			if (s.pass >= 0) out << s.pass; else out << "";
+			for (int e = 0; e < PerfCounters::NumEvents; e++) out << std::right << std::setw(14) << s.counts[e];
+			out << std::setw(8) << std::fixed << std::setprecision(2)
+				<< (s.counts[PerfCounters::Cycles] ? (double)s.counts[PerfCounters::Instructions] / s.counts[PerfCounters::Cycles] : 0.0) << "\n";
+		}
+		out.flags(flags);
+		out.precision(precision);
+	}
 
+private:
+	const char* curPhase;
+	int curPass;
+	uint64_t start[PerfCounters::NumEvents];
+
+	PerfSample* find(const char* phase, int pass)
+	{
+		for (auto& s : samples) { if (s.pass == pass && strcmp(s.phase, phase) == 0) return &s; }
+		PerfSample s;
+		s.phase = phase;
+		s.pass = pass;
+		memset(s.counts, 0, sizeof(s.counts));
+		samples.push_back(s);
+		return &samples.back();
+	}
+}; // class PerfRecorder
+#endif // RADIX_SORT_PERF_COUNTERS
 
 
 //####################################################################################################
@@ -115,38 +723,103 @@ template <typename T, class IndexerMSB0 = IndexIntrinsic<T>, class GetSize = Get
 class Sorter
 {
 public:
+	// How rank() numbers equal keys
+	enum class Ties
+	{
+		Ordinal, // every element gets its own position, equal keys in input order (ROW_NUMBER() - 1)
+		Min,     // equal keys all get the position of the first of them (RANK() - 1)
+		Dense    // equal keys share a rank, and the next key's rank is one higher (DENSE_RANK() - 1)
+	};
 
 private:
-	size_t *A, *B, *currentIndexBuffer; // for view()
+	size_t *A, *B, *currentIndexBuffer; // index scratch for sort_old(); view() uses idxBuf
 	size_t allocSizeA, allocSizeB;
-	T* sortBuf; // for sort()
+	T* sortBuf; // for sort(). Raw storage, no live objects outside of a sort() call.
 	size_t sortBufSize;
 	IndexerMSB0 getByte;
 	GetSize getSize;
 	int maxSize;
 	bool negativeOverride;
 	bool floatOverride;
+	std::shared_ptr<std::atomic<bool>> cancelFlag; // from setCancelToken(), may be null
+	size_t smallSortThreshold; // insertion sort below this
+	size_t prefetchInterval; // elements between bucket prefetches in scatter(), 0 = off
+	bool keepMemory; // from a Tuning, same as passing keepMemoryResources every time
+	size_t indirectBytes; // sort() goes through sortIndirect() if sizeof(T) is at least this, 0 = never
+	std::vector<std::pair<size_t, Tuning>> tuning; // from setProfile(), by increasing minimum size
+	enum { PinSmallSort = 1, PinParallel = 2, PinThreads = 4 };
+	unsigned pinned; // Pin* bits: settings set by hand, which a profile leaves alone
+#ifdef RADIX_SORT_PERF_COUNTERS
+	PerfRecorder* perf; // may be null
+#endif
+	void* idxBuf; // raw storage for view()/rank()/sortColumns() indices, sortIndirect() tags and sortUnique() run starts
+	size_t idxBufBytes;
+	char* colBuf; // for sortColumns(), one column's worth
+	size_t colBufSize;
+	unsigned long long* runBits; // for sortRuns() and friends, 1 bit per element: starts a run of equal keys
+	size_t runBitsWords;
+	size_t* narrowCounts; // for sortNarrow(), one count per key in the range, up to 64K (per task in sortSegments())
+	size_t narrowCountsSize;
+	std::vector<T> spare; // for sort(std::vector<T>&), the second buffer. Live elements, unlike sortBuf.
+#ifndef RADIX_SORT_NO_THREADS
+	ThreadPool* pool; // nullptr = always sort on the calling thread
+	bool ownsPool;
+	size_t parallelThreshold; // below this many elements, don't bother waking the pool
+	unsigned maxTasks; // tasks per parallel job, 0 = the whole pool
+	size_t* parBuckets; // one histogram per task
+	unsigned parBucketsTasks;
+	bool sortBufFresh; // sortBuf was just allocated, no page of it has been touched yet
+#endif
 
 	void init()
 	{
-		allocSizeB = 0;
+		allocSizeA = allocSizeB = 0;
+		currentIndexBuffer = nullptr;
 		maxSize = 0;
 		A = B = nullptr;
 		sortBuf = nullptr;
 		sortBufSize = 0;
 		negativeOverride = false;
 		floatOverride = false;
+		cancelFlag = nullptr;
+		smallSortThreshold = 32;
+		prefetchInterval = 0x8000 / sizeof(T);
+		keepMemory = false;
+		indirectBytes = 128;
+		pinned = 0;
+#ifdef RADIX_SORT_PERF_COUNTERS
+		perf = nullptr;
+#endif
+		runBits = nullptr;
+		runBitsWords = 0;
+		narrowCounts = nullptr;
+		narrowCountsSize = 0;
+		colBuf = nullptr;
+		colBufSize = 0;
+		idxBuf = nullptr;
+		idxBufBytes = 0;
+#ifndef RADIX_SORT_NO_THREADS
+		pool = nullptr;
+		ownsPool = false;
+		parallelThreshold = 0x10000;
+		maxTasks = 0;
+		parBuckets = nullptr;
+		parBucketsTasks = 0;
+		sortBufFresh = false;
+#endif
 	}
 
 public:
 	Sorter() 
 	{
 		init();
+		if (Profile::global()) setProfile(*Profile::global());
 	}
 	Sorter(signed int negative)
 	{
 		init();
 		if (negative < 0) negativeOverride = true;
+		if (Profile::global()) setProfile(*Profile::global());
 	}
 	Sorter(double negative)
 	{
@@ -156,18 +829,53 @@ public:
 			negativeOverride = true;
 			floatOverride = true;
 		}
+		if (Profile::global()) setProfile(*Profile::global());
+	}
+#ifdef RADIX_SORT_PERF_COUNTERS
+	// Record hardware counters for each phase and pass of sort() and view() into recorder. nullptr to stop.
+	void setPerfRecorder(PerfRecorder* recorder) { perf = recorder; }
+#endif
+	// Checked between passes of sort() and view(). See CancelToken.
+	void setCancelToken(const CancelToken& token) { cancelFlag = token.state(); }
+	void clearCancelToken() { cancelFlag = nullptr; }
+
+	~Sorter()
+	{
+		free();
+#ifndef RADIX_SORT_NO_THREADS
+		setThreadPool(nullptr);
+#endif
+	}
+
+#ifndef RADIX_SORT_NO_THREADS
+	// Share a pool with other Sorters. The caller keeps ownership and must keep it alive
+	// as long as this Sorter uses it. nullptr goes back to single threaded.
+	void setThreadPool(ThreadPool* sharedPool)
+	{
+		if (ownsPool) delete pool;
+		pool = sharedPool;
+		ownsPool = false;
+	}
+	// Start a pool that belongs to this Sorter. 0 = one thread per core. Every pass uses all of it,
+	// whatever thread count a profile asks for.
+	void useThreads(unsigned numThreads = 0, bool pinThreads = true)
+	{
+		setThreadPool(nullptr);
+		pool = new ThreadPool(numThreads, pinThreads);
+		ownsPool = true;
+		maxTasks = 0;
+		pinned |= PinThreads;
 	}
-	~Sorter() { free(); }
+	ThreadPool* threadPool() const { return pool; }
+	// Arrays smaller than this are sorted on the calling thread even if there's a pool. Wins over a profile.
+	void setParallelThreshold(size_t numElements) { parallelThreshold = numElements; pinned |= PinParallel; }
+	size_t getParallelThreshold() const { return parallelThreshold; }
+#endif
+	// Allocates view()'s (and rank()'s) index buffers ahead of time. Pass keepMemoryResources to keep them.
 	void preAllocView(size_t numElements)
 	{
-		if (A) delete [] A;
-		if (B) delete[] B;
-		//ivpB = new IndexValuePair[numElements]
-		//B = new IndexValuePair[numElements];
-		//A = new IndexValuePair[numElements];
-		A = new size_t[numElements];
-		B = new size_t[numElements];
-		allocSizeB = numElements;
+		size_t idxSize = ((unsigned long long)numElements <= 0xFFFFFFFFull) ? sizeof(uint32_t) : sizeof(size_t);
+		growIdxBuf(2 * numElements * idxSize);
 	}
 
 	void free()
@@ -180,10 +888,34 @@ public:
 		B = nullptr;
 		allocSizeB = 0;
 
-		if (sortBuf) delete[] sortBuf;
+		if (sortBuf) std::allocator<T>().deallocate(sortBuf, sortBufSize);
 		sortBuf = nullptr;
 		sortBufSize = 0;
 
+#ifndef RADIX_SORT_NO_THREADS
+		if (parBuckets) delete[] parBuckets;
+		parBuckets = nullptr;
+		parBucketsTasks = 0;
+#endif
+
+		if (runBits) delete[] runBits;
+		runBits = nullptr;
+		runBitsWords = 0;
+
+		if (narrowCounts) delete[] narrowCounts;
+		narrowCounts = nullptr;
+		narrowCountsSize = 0;
+
+		if (colBuf) delete[] colBuf;
+		colBuf = nullptr;
+		colBufSize = 0;
+
+		if (idxBuf) ::operator delete(idxBuf);
+		idxBuf = nullptr;
+		idxBufBytes = 0;
+
+		std::vector<T>().swap(spare);
+
 		currentIndexBuffer = nullptr;
 	}
 
@@ -211,147 +943,297 @@ public:
 		{
 			if (sortBufSize * 2 > numElements && sortBufSize < 1000000000) newSize = sortBufSize * 2;
 			else newSize = numElements;
-			if (sortBuf != nullptr) delete[] sortBuf;
-			//ivpA = new IndexValuePair[newSize];
-			//ivpB = new IndexValuePair[newSize];
-			sortBuf = new T[newSize];
+			if (sortBuf != nullptr) std::allocator<T>().deallocate(sortBuf, sortBufSize);
+			// Uninitialized on purpose. Elements are move-constructed into it by the first
+			// scatter pass, so T doesn't need a default constructor and we don't pay for
+			// n constructors + n destructors on every growth.
+			sortBuf = std::allocator<T>().allocate(newSize);
 			sortBufSize = newSize;
+#ifndef RADIX_SORT_NO_THREADS
+			sortBufFresh = true;
+#endif
 		}
 	}
 
 private:
-	void buildView(const T* a, size_t numElements)
-	{
-		//size_t i = 0;
-		growAllocView(numElements);
+	bool cancelRequested() const { return cancelFlag && cancelFlag->load(std::memory_order_relaxed); }
 
-		maxSize = 0;
-		size_t *tmp, *in, *out;
-		in = A;
-		out = B;
-		mint i;
-		size_t buckets[0x100];
+	// One pass of view(), from the indices in `in` to `to`. On the first pass the indices are
+	// still 0..n-1, so we read a[] in order and don't need `in` at all.
+	// ordered = bucket by orderedByte(), so the passes end in sort()'s final order with no negative fix-up
+	template <bool ordered> unsigned char keyByte(const T& x, int i) { return ordered ? orderedByte(x, i) : getByte(x, i); }
 
-		for (i = 0; (size_t)i < numElements; i++)
+	template <bool first, typename Idx, typename Dst, bool ordered = false>
+	void viewPass(const T* a, const Idx* in, Dst* to, size_t numElements, int iByte)
+	{
+		perfMark("histogram", iByte);
+		size_t buckets[0x100];
+		memset(buckets, 0, sizeof(buckets));
+		for (size_t i = 0; i < numElements; i++)
 		{
-			int sz = getSize(a[i]);
-			if (sz > maxSize) maxSize = sz;
-			in[i] = i;
+			size_t v = first ? i : (size_t)in[i];
+#ifndef RADIX_SORT_NO_MMINTRIN
+			// a[in[i]] is a cache miss waiting to happen, ask for it early
+			if (!first && i + 16 < numElements) RADIX_SORT_PREFETCH(&a[in[i + 16]]);
+#endif
+			buckets[keyByte<ordered>(a[v], iByte)]++; // <-- Hot path
 		}
-		for (int b = maxSize - 1; b >= 0; b--)
+		size_t cum = 0;
+		for (int b = 0; b < 0x100; b++)
 		{
-			memset(buckets, 0, 0x100 * sizeof(size_t));
-			for (i = 0; (size_t)i < numElements; i++)
-			{
-				//buckets[getByte(a[in[i]], b)]++; 
-				// Let's break that down...
-				size_t in_i = in[i];
-				
-				const auto& aini = a[in_i];
-				unsigned char byteVal = getByte(aini, b); // <-- Hot path
-				//const auto aval = a[in_i];
-				//unsigned char byteVal = getByte(aval, b); // <-- Hot path
-				// ^ That translates to 2 movss instructions. Not much to do about it at this point.
-				// This makes me think moving the original data around might be faster, since a[in[i]]
-				// causes the array to be accessed in a random order and constantly incur cache misses.
-				// Welp, that's a brick in the face.
-
-				buckets[byteVal]++;
-
-				// Keep buckets in cache
+			cum += buckets[b];
+			buckets[b] = cum;
+		}
+		perfMark("scatter", iByte);
+		size_t i = numElements;
+		while (i > 0)
+		{
+			i--;
+			size_t v = first ? i : (size_t)in[i];
 #ifndef RADIX_SORT_NO_MMINTRIN
-				char* cacheStartAddr = (char*)&buckets[0];
-				char* cacheEndAddr = cacheStartAddr + sizeof(buckets) - 1;
-				for (char* cacheAddr = cacheStartAddr; cacheAddr < cacheEndAddr; cacheAddr += CACHE_LINE_SIZE)
-				{
-					::_mm_prefetch(cacheAddr, 1); // second arg of 1 means we'll need this again later
-				}
-				::_mm_prefetch(cacheEndAddr, 1);
+			if (!first && i >= 16) RADIX_SORT_PREFETCH(&a[in[i - 16]]);
 #endif
-			}
-			size_t cum = 0;
-			for (i = 0; i < 0x100; i++)
-			{
-				cum += buckets[i];
-				buckets[i] = cum;
-			}
-			for (i = numElements - 1; i >= 0; i--)
-			{
-				int iBucket = getByte(a[in[i]], b);
-#ifdef _DEBUG
-				if (buckets[iBucket] == 0) throw std::logic_error("Bug in radix sort: bucket underflow.");
-#endif
-				buckets[iBucket]--;
-				out[buckets[iBucket]] = in[i]; // Hot path
-			}
-
-			tmp = in;
-			in = out;
-			out = tmp;
-			currentIndexBuffer = in;
+			to[--buckets[keyByte<ordered>(a[v], iByte)]] = (Dst)v; // Hot path
+		}
+	}
 
-		} // for b
+	// The radix passes of view(). Indices ping-pong between two internal buffers of Idx, which is
+	// uint32_t whenever n fits, to halve the memory traffic of size_t. The last pass writes straight
+	// into the caller's array, in the caller's type, so there's no copy at the end.
+	template <typename Idx, typename Out>
+	void radixView(const T* a, size_t numElements, Out* out)
+	{
+		perfMark("key sizes");
+		int maxBytes = 0;
+		for (size_t i = 0; i < numElements; i++) maxBytes = std::max(maxBytes, (int)getSize(a[i]));
 
+		if (maxBytes == 0)
+		{
+			for (size_t i = 0; i < numElements; i++) out[i] = (Out)i;
+		}
+		else
+		{
+			Idx* in = nullptr;
+			Idx* to = nullptr;
+			if (maxBytes > 1)
+			{
+				growIdxBuf(2 * numElements * sizeof(Idx));
+				in = (Idx*)idxBuf;
+				to = in + numElements;
+			}
+			for (int b = maxBytes - 1; b >= 0; b--)
+			{
+				if (cancelRequested()) { perfMark(nullptr); throw SortCancelled(); }
+				bool first = (b == maxBytes - 1);
+				if (b == 0)
+				{
+					if (first) viewPass<true>(a, in, out, numElements, b);
+					else viewPass<false>(a, in, out, numElements, b);
+				}
+				else
+				{
+					if (first) viewPass<true>(a, in, to, numElements, b);
+					else viewPass<false>(a, in, to, numElements, b);
+					std::swap(in, to);
+				}
+			}
+		}
 
 		if (negativeOverride || std::is_signed<T>::value)
 		{
-			// Move negative numbers to the beginning of the array and reverse order
-			// At this point, they will be at the end, because sign bit is most significant
-			// First, binary search for start of negatives.
-
-			// Not searching for an exact element here, so I don't think this will work...
-			//std::binary_search(in, in + numElements, 
-
-			//size_t negStartMin = numElements >> 1;
-			//size_t negStartMax = numElements - 1;
-			size_t negStart = numElements >> 1;
-			size_t negDelta = numElements >> 2;
-			//while (negStartMax > negStartMin)
-			//while ((getByte(a[in[negStart]], 0) & 0x80) == 0 || (getByte(a[in[negStart - 1]], 0) & 0x80) != 0 || negStart == 0 || negStart >= numElements)
-			while ((negStart > 0) && (negStart < numElements) && !(
-			(getByte(a[in[negStart]], 0) & 0x80) != 0 && (getByte(a[in[negStart - 1]], 0) & 0x80) == 0  
-			))
+			// Same as sort(): negatives are at the end, move them to the front, and reverse them for floats.
+			perfMark("negatives");
+			size_t negStart = findNegStart(numElements, [a, out](size_t i) -> const T& { return a[out[i]]; });
+			if (negStart < numElements)
 			{
-				//if (a[in[negStartMin]] < 0)
-				//if (a[in[negStart]] < 0)
-				//{
-				//	//if (negStartMin == numElements - 1 || a[in[negStartMin + 1]] >= 0)
-				//	if (negStart == numElements - 1 || a[in[negStart + 1]] >= 0)
-				//	{
-				//		negStart = negStartMin;
-				//		break;
-				//	}
-				//	negStart -= negDelta;
-				//}
-				//else if (a[in[negStartMin]] >= 0) {negStartMin += negDelta + 1;}
-				//else if (a[in[negStartMax]] < 0) {negStartMax += }
-
-				if (getByte(a[in[negStart]], 0) & 0x80) negStart -= negDelta;
-				else negStart += negDelta;
-				negDelta >>= 1;
-				if (negDelta < 1) negDelta = 1;
+				std::rotate(out, out + negStart, out + numElements);
+				if (floatOverride || std::is_floating_point<T>::value) std::reverse(out, out + (numElements - negStart));
 			}
-			size_t negCount = numElements - negStart;
-			if (negStart < numElements)
+		}
+		perfMark(nullptr);
+	}
+
+	// The last pass of rank(). It goes forward, so the first element of every run of equal keys is
+	// placed first and the whole run can get its position. For Dense, each run gets its number within
+	// its bucket, and a sequential pass at the end adds the number of distinct keys in earlier buckets.
+	// Ordinal ranks of floats come from rankPassReversed() instead.
+	template <bool first, typename Idx, typename R>
+	void rankPass(const T* a, const Idx* in, R* ranks, size_t numElements, int numBytes, Ties ties)
+	{
+		if (ties == Ties::Ordinal && (floatOverride || std::is_floating_point<T>::value))
+		{
+			rankPassReversed<first>(a, in, ranks, numElements);
+			return;
+		}
+		perfMark("histogram", 0);
+		size_t buckets[0x100];
+		memset(buckets, 0, sizeof(buckets));
+		for (size_t i = 0; i < numElements; i++)
+		{
+			size_t v = first ? i : (size_t)in[i];
+#ifndef RADIX_SORT_NO_MMINTRIN
+			if (!first && i + 16 < numElements) RADIX_SORT_PREFETCH(&a[in[i + 16]]);
+#endif
+			buckets[orderedByte(a[v], 0)]++;
+		}
+		size_t cum = 0;
+		for (int b = 0; b < 0x100; b++)
+		{
+			size_t c = buckets[b];
+			buckets[b] = cum;
+			cum += c;
+		}
+		perfMark("scatter", 0);
+		const size_t none = std::numeric_limits<size_t>::max();
+		size_t prev[0x100]; // last element put in each bucket
+		size_t runRank[0x100]; // rank of the run that element is in
+		size_t runsIn[0x100]; // runs started in each bucket so far, for Dense
+		if (ties != Ties::Ordinal)
+		{
+			std::fill(prev, prev + 0x100, none);
+			memset(runsIn, 0, sizeof(runsIn));
+		}
+		for (size_t i = 0; i < numElements; i++)
+		{
+			size_t v = first ? i : (size_t)in[i];
+#ifndef RADIX_SORT_NO_MMINTRIN
+			if (!first && i + 16 < numElements) RADIX_SORT_PREFETCH(&a[in[i + 16]]);
+#endif
+			unsigned char b = orderedByte(a[v], 0);
+			size_t pos = buckets[b]++;
+			if (ties == Ties::Ordinal) { ranks[v] = (R)pos; continue; }
+			// The previous element of this bucket is the one right before in sorted order
+			if (prev[b] == none || !sameKey(a[v], a[prev[b]], 1, numBytes)) runRank[b] = (ties == Ties::Min) ? pos : runsIn[b]++;
+			prev[b] = v;
+			ranks[v] = (R)runRank[b];
+		}
+		if (ties == Ties::Dense)
+		{
+			perfMark("dense ranks");
+			size_t base[0x100];
+			size_t runs = 0;
+			for (int b = 0; b < 0x100; b++) { base[b] = runs; runs += runsIn[b]; }
+			for (size_t i = 0; i < numElements; i++) ranks[i] = (R)(ranks[i] + base[orderedByte(a[i], 0)]);
+		}
+	}
+
+	// Ordinal ranks for floats. sort() and view() end up with equal negative floats in reverse
+	// order, because the negatives get reversed after the passes. The earlier passes here used raw
+	// bytes like theirs, so walking backwards and filling the negative buckets from the front gives
+	// the same order. The other buckets fill from the back, which keeps them in forward order.
+	template <bool first, typename Idx, typename R>
+	void rankPassReversed(const T* a, const Idx* in, R* ranks, size_t numElements)
+	{
+		perfMark("histogram", 0);
+		size_t buckets[0x100];
+		memset(buckets, 0, sizeof(buckets));
+		for (size_t i = 0; i < numElements; i++)
+		{
+			size_t v = first ? i : (size_t)in[i];
+#ifndef RADIX_SORT_NO_MMINTRIN
+			if (!first && i + 16 < numElements) RADIX_SORT_PREFETCH(&a[in[i + 16]]);
+#endif
+			buckets[orderedByte(a[v], 0)]++;
+		}
+		// Negative buckets (below 0x80) start at their first slot, the others at one past their last
+		size_t cum = 0;
+		for (int b = 0; b < 0x100; b++)
+		{
+			size_t c = buckets[b];
+			buckets[b] = (b < 0x80) ? cum : cum + c;
+			cum += c;
+		}
+		perfMark("scatter", 0);
+		size_t i = numElements;
+		while (i > 0)
+		{
+			i--;
+			size_t v = first ? i : (size_t)in[i];
+#ifndef RADIX_SORT_NO_MMINTRIN
+			if (!first && i >= 16) RADIX_SORT_PREFETCH(&a[in[i - 16]]);
+#endif
+			unsigned char b = orderedByte(a[v], 0);
+			ranks[v] = (R)((b < 0x80) ? buckets[b]++ : --buckets[b]);
+		}
+	}
+
+	template <typename Idx, typename R>
+	void radixRank(const T* a, size_t numElements, R* ranks, Ties ties)
+	{
+		perfMark("key sizes");
+		int maxBytes = 0;
+		for (size_t i = 0; i < numElements; i++) maxBytes = std::max(maxBytes, (int)getSize(a[i]));
+
+		if (maxBytes == 0)
+		{
+			// No bytes, so every key is the same
+			for (size_t i = 0; i < numElements; i++) ranks[i] = (R)(ties == Ties::Ordinal ? i : 0);
+		}
+		else if (maxBytes == 1) rankPass<true, Idx>(a, nullptr, ranks, numElements, maxBytes, ties);
+		else
+		{
+			growIdxBuf(2 * numElements * sizeof(Idx));
+			Idx* in = (Idx*)idxBuf;
+			Idx* to = in + numElements;
+			// rankPassReversed() wants the raw byte order, like view()
+			bool ordered = !(ties == Ties::Ordinal && (floatOverride || std::is_floating_point<T>::value));
+			for (int b = maxBytes - 1; b > 0; b--)
 			{
-				memcpy(out, in + negStart, negCount * sizeof(size_t));
-				memmove(in + negCount, in, negStart * sizeof(size_t));
-				memcpy(in, out, negCount * sizeof(size_t));
-				if (floatOverride || std::is_floating_point<T>::value)
+				if (cancelRequested()) { perfMark(nullptr); throw SortCancelled(); }
+				bool first = (b == maxBytes - 1);
+				if (ordered)
 				{
-					// Integer wrap-around/overflow of negative numbers preserves order here, but
-					// floating point types will be reversed, because the binary value is the same
-					// whether positive or negative, except the sign bit.
-					// Basically floats are backwards.
-					size_t negSwapLo = 0;
-					size_t negSwapHi = negCount - 1;
-					while (negSwapLo < negSwapHi) std::swap(in[negSwapLo++], in[negSwapHi--]);
+					if (first) viewPass<true, Idx, Idx, true>(a, in, to, numElements, b);
+					else viewPass<false, Idx, Idx, true>(a, in, to, numElements, b);
+				}
+				else
+				{
+					if (first) viewPass<true, Idx, Idx, false>(a, in, to, numElements, b);
+					else viewPass<false, Idx, Idx, false>(a, in, to, numElements, b);
 				}
+				std::swap(in, to);
 			}
-		} // if negatives
+			if (cancelRequested()) { perfMark(nullptr); throw SortCancelled(); }
+			rankPass<false>(a, in, ranks, numElements, maxBytes, ties);
+		}
+		perfMark(nullptr);
+	}
+
+	template <typename Out>
+	void viewInto(const T* a, Out* out, size_t numElements)
+	{
+		if ((unsigned long long)numElements <= 0xFFFFFFFFull) radixView<uint32_t>(a, numElements, out);
+		else radixView<size_t>(a, numElements, out);
+	}
 
+	void growIdxBuf(size_t bytes)
+	{
+		if (idxBufBytes < bytes)
+		{
+			if (idxBuf) ::operator delete(idxBuf);
+			idxBuf = ::operator new(bytes);
+			idxBufBytes = bytes;
+		}
+	}
 
+	// The most counts sortNarrow() can want for numElements elements
+	static size_t narrowCountsFor(size_t numElements) { return std::min<size_t>(0x10000, 4 * numElements + 4); }
+	void growNarrowCounts(size_t numCounts)
+	{
+		if (narrowCountsSize < numCounts)
+		{
+			if (narrowCounts) delete[] narrowCounts;
+			narrowCounts = new size_t[numCounts];
+			narrowCountsSize = numCounts;
+		}
+	}
 
+	// Fills A with the sorted order, for sort_old()
+	void buildView(const T* a, size_t numElements)
+	{
+		growAllocView(numElements);
+		viewInto(a, A, numElements);
+		currentIndexBuffer = A;
 	} // buildView()
 
 public:
@@ -382,163 +1264,1665 @@ public:
 			in[out[i]] = in[i];
 			out[in[i]] = out[i];
 		}
-		if (!keepMemoryResources) { free(); }
+		if (!keepMemoryResources && !keepMemory) { free(); }
 	}
 
 	void view(const T* a, size_t *IndecesOut, size_t numElements, bool keepMemoryResources = false)
 	{
-		buildView(a, numElements);
-		size_t* in = currentIndexBuffer;
-		// "in" is really out, weird but that's because of buffer swapping
-		memcpy(in, IndecesOut, numElements * sizeof(size_t));
-		if (!keepMemoryResources) { free(); }
+		tuneFor(numElements);
+		viewInto(a, IndecesOut, numElements);
+		if (!keepMemoryResources && !keepMemory) { free(); }
+	}
+
+	// ranksOut[i] = the position a[i] would have after view() or sort(), without moving anything, equal keys
+	// included (except for arrays under the insertion sort threshold, where sort() keeps equal negative floats
+	// in their original order). This is the inverse of view(), but it comes straight out of the last radix
+	// pass instead of inverting view()'s output.
+	// Ranks start at 0; IntType has to be big enough to hold numElements - 1.
+	template <typename IntType>
+	void rank(const T* a, IntType* ranksOut, size_t numElements, Ties ties = Ties::Ordinal, bool keepMemoryResources = false)
+	{
+		static_assert(std::is_integral<IntType>::value, "Output array must be of an integer type.");
+		if (numElements > 0 && (unsigned long long)(numElements - 1) > (unsigned long long)std::numeric_limits<IntType>::max())
+		{
+			throw std::length_error("rank(): IntType is too small for this many elements.");
+		}
+		tuneFor(numElements);
+		if ((unsigned long long)numElements <= 0xFFFFFFFFull) radixRank<uint32_t>(a, numElements, ranksOut, ties);
+		else radixRank<size_t>(a, numElements, ranksOut, ties);
+		if (!keepMemoryResources && !keepMemory) { free(); }
 	}
 
+	// view() into any integer type big enough to index numElements, e.g. uint32_t to save memory.
 	template<typename IntType>
 	void viewCast(const T* a, IntType* IndecesOut, size_t numElements, bool keepMemoryResources = false)
 	{
 		static_assert(std::is_integral<IntType>::value, "Output array must be of an integer type.");
-		buildView(a, numElements);
-		size_t* in = currentIndexBuffer;
-		for (size_t i = 0; i < numElements; i++)
+		if (numElements > 0 && (unsigned long long)(numElements - 1) > (unsigned long long)std::numeric_limits<IntType>::max())
 		{
-			IndecesOut[i] = static_cast<IntType>(in[i]);
+			throw std::length_error("viewCast(): IntType is too small to index this many elements.");
 		}
-		if (!keepMemoryResources) { free(); }
+		tuneFor(numElements);
+		viewInto(a, IndecesOut, numElements);
+		if (!keepMemoryResources && !keepMemory) { free(); }
 	}
 
 	static void mv(T* dest, T* src, size_t count)
 	{
-		if (std::is_class<T>::value)
+		mv(dest, src, count, std::is_trivially_copyable<T>());
+	}
+	static void mv(T* dest, T* src, size_t count, std::false_type /*trivially copyable*/)
+	{
+		size_t i;
+		if (dest < src) { for (i = 0; i < count; i++) dest[i  ] = std::move(src[i  ]); }
+		else            { for (i = count; i > 0; i--) dest[i-1] = std::move(src[i-1]); }
+	}
+	static void mv(T* dest, T* src, size_t count, std::true_type /*trivially copyable*/)
+	{
+		memmove(dest, src, count * sizeof(T));
+	}
+
+	// Like mv(), but dest is raw memory. Ranges must not overlap.
+	static void mvConstruct(T* dest, T* src, size_t count)
+	{
+		for (size_t i = 0; i < count; i++) ::new ((void*)(dest + i)) T(std::move(src[i]));
+	}
+
+	static void destroy(T* p, size_t count)
+	{
+		if (!std::is_trivially_destructible<T>::value)
 		{
-			size_t i;
-			if (dest < src) { for (i = 0; i < count; i++) dest[i  ] = std::move(src[i  ]); }
-			else            { for (i = count; i > 0; i--) dest[i-1] = std::move(src[i-1]); }
+			for (size_t i = 0; i < count; i++) p[i].~T();
 		}
-		else
+	}
+
+private:
+	// Starts the next phase for the PerfRecorder, nullptr ends the last one. Nothing without RADIX_SORT_PERF_COUNTERS.
+#ifdef RADIX_SORT_PERF_COUNTERS
+	inline void perfMark(const char* phase, int pass = -1) { if (perf) perf->mark(phase, pass); }
+#else
+	inline void perfMark(const char* /*phase*/, int /*pass*/ = -1) {}
+#endif
+
+	static inline void place(T* slot, T& value, std::true_type /*construct*/) { ::new ((void*)slot) T(std::move(value)); }
+	static inline void place(T* slot, T& value, std::false_type /*assign*/) { *slot = std::move(value); }
+
+	// One scatter pass: moves every element of src into its bucket in dest.
+	// constructDest = true when dest is raw sortBuf memory that holds no objects yet.
+	template <bool constructDest>
+	void scatter(T* src, T* dest, size_t numElements, int iByte, size_t* buckets)
+	{
+		size_t iData = numElements;
+		size_t untilPrefetch = prefetchInterval;
+		while (iData > 0)
+		{
+			iData--;
+			place(&dest[--buckets[getByte(src[iData], iByte)]], src[iData], std::integral_constant<bool, constructDest>());
+
+#ifndef RADIX_SORT_NO_MMINTRIN
+			// If this block is giving you errors, it can be safely commented out.
+			// This is an optimization to keep certain things in cache.
+			if (untilPrefetch && --untilPrefetch == 0)
+			{
+				untilPrefetch = prefetchInterval;
+				char* cacheStartAddr = (char*)&buckets[0];
+				char* cacheEndAddr = cacheStartAddr + 0x100 * sizeof(size_t) - 1;
+				for (char* cacheAddr = cacheStartAddr; cacheAddr < cacheEndAddr; cacheAddr += CACHE_LINE_SIZE)
+				{
+					RADIX_SORT_PREFETCH(cacheAddr); // we'll need this again later
+				}
+				RADIX_SORT_PREFETCH(cacheEndAddr);
+			}
+#endif
+		}
+	}
+
+	// True if a and b have the same bytes in [fromByte, numBytes)
+	bool sameKey(const T& a, const T& b, int fromByte, int numBytes)
+	{
+		for (int i = fromByte; i < numBytes; i++) { if (getByte(a, i) != getByte(b, i)) return false; }
+		return true;
+	}
+
+	static void setBit(unsigned long long* bits, size_t i) { bits[i >> 6] |= 1ull << (i & 63); }
+
+	// scatter() for the last pass (byte 0) when the caller wants runs of equal keys.
+	// Elements reach each bucket in sorted order, and since buckets fill from the back, each one
+	// lands right in front of the previous element of the same bucket. Comparing those two finds
+	// every run start as we go, with no extra pass over the data. Bits are positions in dest.
+	template <bool constructDest>
+	void scatterMarkRuns(T* src, T* dest, size_t numElements, size_t* buckets, int numBytes, unsigned long long* bits)
+	{
+		size_t bucketEnd[0x100];
+		memcpy(bucketEnd, buckets, sizeof(bucketEnd));
+		size_t iData = numElements;
+		while (iData > 0)
+		{
+			iData--;
+			unsigned char b = getByte(src[iData], 0);
+			size_t pos = --buckets[b];
+			place(&dest[pos], src[iData], std::integral_constant<bool, constructDest>());
+			if (pos + 1 < bucketEnd[b] && !sameKey(dest[pos], dest[pos + 1], 1, numBytes)) setBit(bits, pos + 1);
+		}
+		for (int b = 0; b < 0x100; b++)
 		{
-			memmove(dest, src, count * sizeof(T));
+			if (buckets[b] < bucketEnd[b]) setBit(bits, buckets[b]);
 		}
 	}
 
-	void sort(T* data, size_t numElements, bool keepMemoryResources = false) //, M T::* value, bool hasNegative)
+	// Like scatter(), but for one task's slice [lo, hi) of src, walking forward from the
+	// start offsets in buckets. Slices are laid out in order, so this is still stable.
+	// With carryIndex, isrc[i] moves to idest along with src[i] (for sortColumns()).
+	template <bool constructDest, bool carryIndex, typename Idx>
+	static void scatterSlice(IndexerMSB0& gb, T* src, T* dest, size_t lo, size_t hi, int iByte, size_t* buckets, const Idx* isrc, Idx* idest)
 	{
-		// TODO: observe the resource management options but we only need one buffer here 
-		
-		growAllocSort(numElements);
-		T* src = data;
-		T* dest = sortBuf; //new T[numElements];
-		size_t buckets[0x100];
-		int iByte; // sizeof(T);
-		//size_t maxSize = 0;
-		for (int i = 0; (size_t)i < numElements; i++)
+		for (size_t iData = lo; iData < hi; iData++)
 		{
-			int sz = getSize(data[i]);
-			if (sz > maxSize) maxSize = sz;
+			size_t pos = buckets[gb(src[iData], iByte)]++;
+			place(&dest[pos], src[iData], std::integral_constant<bool, constructDest>());
+			if (carryIndex) idest[pos] = isrc[iData];
 		}
+	}
 
+#ifndef RADIX_SORT_NO_THREADS
+	// Tasks per parallel job: the whole pool, unless the Tuning says fewer
+	unsigned poolTasks() const { return (maxTasks && maxTasks < pool->size()) ? maxTasks : pool->size(); }
 
- 		iByte = maxSize;
-		while (iByte > 0)
+	// All the radix passes of sort(), spread over the pool. Each task owns a contiguous slice of
+	// the array and keeps it for every pass: histogram its slice, then (after the offsets are
+	// summed across tasks) scatter its slice.
+	// Returns false if it stopped early because of a CancelToken.
+	bool radixPassesParallel(T*& src, T*& dest, T* scratch, size_t numElements, size_t& scratchLive, int& maxBytes)
+	{
+		uint32_t* noIndex = nullptr;
+		return radixPassesParallel(src, dest, scratch, numElements, scratchLive, maxBytes, noIndex, noIndex);
+	}
+	// Same, carrying an index per element from isrc to idest, unless they're null. Swaps them along with src and dest.
+	template <typename Idx>
+	bool radixPassesParallel(T*& src, T*& dest, T* scratch, size_t numElements, size_t& scratchLive, int& maxBytes, Idx*& isrc, Idx*& idest)
+	{
+		unsigned nTasks = poolTasks();
+		if (parBucketsTasks < nTasks)
 		{
-			iByte--;
-			memset(buckets, 0, sizeof(buckets));
-			size_t iData = 0;
-			for (size_t iData = 0; iData < numElements; iData++)
-			{
-				//buckets[(getByte(src[iData], iByte) >> (iByte << 3)) & 0xFF] ++;
-				buckets[getByte(src[iData], iByte)] ++;
-			}
-			size_t cum = 0; // cumulative total
-			for (int iBucket = 0; iBucket < 0x100; iBucket++)
+			if (parBuckets) delete[] parBuckets;
+			parBuckets = new size_t[0x100 * (size_t)nTasks];
+			parBucketsTasks = nTasks;
+		}
+		size_t slice = (numElements + nTasks - 1) / nTasks;
+		auto sliceLo = [&](unsigned t) { return std::min(numElements, slice * t); };
+		auto sliceHi = [&](unsigned t) { return std::min(numElements, slice * (t + 1)); };
+
+		if (sortBufFresh && scratch == sortBuf)
+		{
+			// First touch decides which NUMA node a page lands on. Have each task touch its own slice.
+			auto touchJob = [&](unsigned t)
 			{
-				cum += buckets[iBucket];
-				buckets[iBucket] = cum;
+				char* lo = (char*)(scratch + sliceLo(t));
+				char* hi = (char*)(scratch + sliceHi(t));
+				for (char* p = lo; p < hi; p += 0x1000) *p = 0;
+			};
+			pool->run(nTasks, touchJob);
+			sortBufFresh = false;
+		}
 
+		// Reuse the bucket space to collect each task's max element size
+		perfMark("key sizes");
+		auto sizeJob = [&](unsigned t)
+		{
+			GetSize gs(getSize);
+			size_t mx = 0;
+			for (size_t i = sliceLo(t); i < sliceHi(t); i++)
+			{
+				size_t sz = (size_t)gs(src[i]);
+				if (sz > mx) mx = sz;
 			}
+			parBuckets[0x100 * (size_t)t] = mx;
+		};
+		pool->run(nTasks, sizeJob);
+		maxBytes = 0;
+		for (unsigned t = 0; t < nTasks; t++) maxBytes = std::max(maxBytes, (int)parBuckets[0x100 * (size_t)t]);
 
-			iData = numElements;
-			while (iData > 0)
+		for (int iByte = maxBytes - 1; iByte >= 0; iByte--)
+		{
+			if (cancelRequested()) return false;
+			perfMark("histogram", iByte);
+			auto histJob = [&](unsigned t)
+			{
+				IndexerMSB0 gb(getByte);
+				size_t* bk = parBuckets + 0x100 * (size_t)t;
+				memset(bk, 0, 0x100 * sizeof(size_t));
+				for (size_t i = sliceLo(t); i < sliceHi(t); i++) bk[gb(src[i], iByte)]++;
+			};
+			pool->run(nTasks, histJob);
+
+			// Exclusive prefix sum, bucket major then task, so each task gets its own start offsets
+			size_t cum = 0;
+			for (int b = 0; b < 0x100; b++)
 			{
-				iData--;
-				dest[--buckets[getByte(src[iData], iByte)]] = src[iData];
+				for (unsigned t = 0; t < nTasks; t++)
+				{
+					size_t c = parBuckets[0x100 * (size_t)t + b];
+					parBuckets[0x100 * (size_t)t + b] = cum;
+					cum += c;
+				}
+			}
 
-#ifndef RADIX_SORT_NO_MMINTRIN
-				// If this block is giving you errors, it can be safely commented out.
-				// This is an optimization to keep certain things in cache.
-				if ((iData % (0x8000 / sizeof(T))) == 0)
+			perfMark("scatter", iByte);
+			bool construct = (dest == scratch && scratchLive < numElements);
+			bool carry = (isrc != nullptr);
+			auto scatterJob = [&](unsigned t)
+			{
+				IndexerMSB0 gb(getByte);
+				size_t bk[0x100];
+				memcpy(bk, parBuckets + 0x100 * (size_t)t, sizeof(bk));
+				size_t lo = sliceLo(t), hi = sliceHi(t);
+				if (carry)
 				{
-					char* cacheStartAddr = (char*)&buckets[0];
-					char* cacheEndAddr = cacheStartAddr + sizeof(buckets) - 1;
-					for (char* cacheAddr = cacheStartAddr; cacheAddr < cacheEndAddr; cacheAddr += CACHE_LINE_SIZE)
-					{
-						::_mm_prefetch(cacheAddr, 1); // second arg of 1 means we'll need this again later
-					}
-					::_mm_prefetch(cacheEndAddr, 1);
+					if (construct) scatterSlice<true, true>(gb, src, dest, lo, hi, iByte, bk, isrc, idest);
+					else scatterSlice<false, true>(gb, src, dest, lo, hi, iByte, bk, isrc, idest);
 				}
+				else
+				{
+					if (construct) scatterSlice<true, false>(gb, src, dest, lo, hi, iByte, bk, isrc, idest);
+					else scatterSlice<false, false>(gb, src, dest, lo, hi, iByte, bk, isrc, idest);
+				}
+			};
+			pool->run(nTasks, scatterJob);
+			if (construct) scratchLive = numElements;
+			std::swap(src, dest);
+			std::swap(isrc, idest);
+		}
+		return true;
+	}
+
+	// Run starts for data that's already sorted, for the parallel path. Each task gets a whole
+	// number of bitmap words, so no two tasks write the same word.
+	void markRunsParallel(T* data, size_t numElements, int numBytes)
+	{
+		unsigned nTasks = poolTasks();
+		size_t words = (numElements + 63) >> 6;
+		size_t wordsPerTask = (words + nTasks - 1) / nTasks;
+		auto markJob = [&](unsigned t)
+		{
+			size_t lo = std::min(numElements, (wordsPerTask * t) << 6);
+			size_t hi = std::min(numElements, (wordsPerTask * (t + 1)) << 6);
+			for (size_t i = lo; i < hi; i++)
+			{
+				if (i == 0 || !sameKey(data[i - 1], data[i], 0, numBytes)) setBit(runBits, i);
+			}
+		};
+		pool->run(nTasks, markJob);
+	}
 #endif
 
+	// Turns runBits (positions before the negative fix-up) into run starts in the final order.
+	// Negatives were at [negStart, n) and got moved to the front, reversed for floats.
+	size_t collectRuns(size_t* starts, size_t numElements, size_t negStart, bool negReversed)
+	{
+		size_t negCount = numElements - negStart;
+		size_t k = 0;
+		// Appends the set bits in [lo, hi), renumbered so lo becomes newLo
+		auto scan = [&](size_t lo, size_t hi, size_t newLo)
+		{
+			for (size_t w = lo >> 6; w < ((hi + 63) >> 6); w++)
+			{
+				unsigned long long x = runBits[w];
+				while (x)
+				{
+					size_t i = (w << 6) + lowestBit(x);
+					x &= x - 1;
+					if (i >= lo && i < hi) starts[k++] = i - lo + newLo;
+				}
 			}
-			std::swap(src, dest);
-		} // iByte
+		};
+		scan(negStart, numElements, 0);
+		if (negReversed && k > 0)
+		{
+			// Run [s_j, s_j+1) becomes [negCount - s_j+1, negCount - s_j)
+			std::reverse(starts, starts + k);
+			for (size_t j = k - 1; j > 0; j--) starts[j] = negCount - starts[j - 1];
+			starts[0] = 0;
+		}
+		scan(0, negStart, negCount);
+		return k;
+	}
 
 
-		if (negativeOverride || std::is_signed<T>::value)
+	// Orders a before b the same way the radix passes and the negative fix-up below would.
+	bool keyLess(const T& a, const T& b, int numBytes)
+	{
+		bool isSigned = negativeOverride || std::is_signed<T>::value;
+		bool isFloat = floatOverride || std::is_floating_point<T>::value;
+		// Flipping the sign bit puts negatives first. Negative floats also have every other bit flipped,
+		// since a bigger magnitude means a smaller number.
+		unsigned char flipA0 = 0, flipA = 0, flipB0 = 0, flipB = 0;
+		if (isSigned && numBytes > 0)
 		{
-			// Move negative numbers to the beginning of the array and reverse order
-			// At this point, they will be at the end, because sign bit is most significant
-			// First, binary search for start of negatives.
-
-			size_t negStart = numElements >> 1;
-			size_t negDelta = numElements >> 2;
-			while ((negStart > 0) && (negStart < numElements) && !(
-				(getByte(src[negStart], 0) & 0x80) != 0 && (getByte(src[negStart - 1], 0) & 0x80) == 0
-				))
+			flipA0 = flipB0 = 0x80;
+			if (isFloat)
 			{
-				if (getByte(src[negStart], 0) & 0x80) negStart -= negDelta;
-				else negStart += negDelta;
-				negDelta >>= 1;
-				if (negDelta < 1) negDelta = 1;
+				if (getByte(a, 0) & 0x80) { flipA0 = flipA = 0xFF; }
+				if (getByte(b, 0) & 0x80) { flipB0 = flipB = 0xFF; }
 			}
-			size_t negCount = numElements - negStart;
-			if (negStart < numElements)
-			{
-				//memcpy(dest, src + negStart, negCount * sizeof(T));
-				//memmove(src + negCount, src, negStart * sizeof(T));
-				//memcpy(src, dest, negCount * sizeof(T));
-
-				mv(dest, src + negStart, negCount);
-				mv(src + negCount, src, negStart);
-				mv(src, dest, negCount);
+		}
+		for (int i = 0; i < numBytes; i++)
+		{
+			unsigned char ba = getByte(a, i) ^ (i == 0 ? flipA0 : flipA);
+			unsigned char bb = getByte(b, i) ^ (i == 0 ? flipB0 : flipB);
+			if (ba != bb) return ba < bb;
+		}
+		return false;
+	}
 
-				//std::swap(src, dest);
-				if (floatOverride || std::is_floating_point<T>::value)
-				{
-					// Integer wrap-around/overflow of negative numbers preserves order here, but
-					// floating point types will be reversed, because the binary value is the same
-					// whether positive or negative, except the sign bit.
-					// Basically floats are backwards.
-					size_t negSwapLo = 0;
-					size_t negSwapHi = negCount - 1;
-					while (negSwapLo < negSwapHi) std::swap(src[negSwapLo++], src[negSwapHi--]);
-				}
+	// x's key in sort order, for non-float keys of up to 8 bytes: its bytes, byte 0 on top, with the sign bit
+	// flipped if it has one. Left aligned in 64 bits, so shorter keys compare the way the radix passes see
+	// them, as if padded with 0 bytes.
+	uint64_t packedKey(const T& x, int sz) { return packedKey(x, sz, PlainInt()); }
+	uint64_t packedKey(const T& x, int sz, std::false_type /*plain integer*/)
+	{
+		uint64_t k = 0;
+		for (int i = 0; i < sz; i++) k |= (uint64_t)getByte(x, i) << (56 - 8 * i);
+		return (negativeOverride || std::is_signed<T>::value) ? k ^ (1ull << 63) : k;
+	}
+	// The bytes are the value's, so skip the indexer
+	uint64_t packedKey(const T& x, int /*sz*/, std::true_type /*plain integer*/)
+	{
+		return ((uint64_t)(typename std::make_unsigned<T>::type)x ^ signBit()) << (64 - 8 * sizeof(T));
+	}
+	// The sign bit of a plain integer T, if this Sorter treats it as signed
+	uint64_t signBit() const { return (negativeOverride || std::is_signed<T>::value) ? (uint64_t)1 << (8 * sizeof(T) - 1) : 0; }
+
+	// True if T is an integer sorted by its value with the stock indexer and size: the key is the whole element
+	typedef std::integral_constant<bool, std::is_integral<T>::value && !std::is_same<T, bool>::value && std::is_same<GetSize, GetSizeIntrinsic<T>>::value &&
+		(std::is_same<IndexerMSB0, IndexIntrinsic<T>>::value || std::is_same<IndexerMSB0, IndexInt<T>>::value)> PlainInt;
+
+	// For sortRange(): sorts by each key minus the smallest one, when that takes fewer passes than the
+	// keys themselves. Keys within 64K of each other take one counting sort pass, and plain integers
+	// don't even need that: the output is written straight from the counts. Otherwise plain integers
+	// get a pass for each byte the differences need, and nothing else does. The keys are in sort order,
+	// so there's no negative fix-up, and equal keys keep their order, like the usual passes.
+	// counts has room for the range's counts, or is null to use narrowCounts.
+	// Returns false, having done nothing, if it wouldn't save a pass.
+	bool sortNarrow(T*& src, T*& dest, T* scratch, size_t numElements, int numBytes, uint64_t minKey, uint64_t maxKey, size_t& scratchLive, bool& cancelled, size_t* counts)
+	{
+		const int shift = 64 - 8 * numBytes;
+		const uint64_t range = (maxKey - minKey) >> shift;
+		auto offsetOf = [&](const T& x) { return (packedKey(x, getSize(x)) - minKey) >> shift; };
+		if (range < 0x10000 && range / 4 < numElements) // keep narrowCountsFor() in step
+		{
+			if (cancelRequested()) { cancelled = true; return true; }
+			perfMark("histogram");
+			size_t numCounts = (size_t)range + 1;
+			if (!counts)
+			{
+				growNarrowCounts(numCounts);
+				counts = narrowCounts;
 			}
-		} // if negatives
+			memset(counts, 0, numCounts * sizeof(size_t));
+			for (size_t i = 0; i < numElements; i++) counts[offsetOf(src[i])]++;
+			perfMark("scatter");
+			countingScatter(src, dest, scratch, numElements, counts, numCounts, scratchLive, PlainInt(), minKey, shift);
+			return true;
+		}
 
+		// Working out the key each pass only pays off when it's cheap
+		if (!PlainInt::value) return false;
+		int rangeBytes = 0;
+		while (rangeBytes < 8 && (range >> (8 * rangeBytes))) rangeBytes++;
+		if (rangeBytes >= numBytes) return false;
+		size_t next[0x100];
+		for (int b = 0; b < rangeBytes; b++)
+		{
+			if (cancelRequested()) { cancelled = true; return true; }
+			perfMark("histogram", b);
+			memset(next, 0, sizeof(next));
+			for (size_t i = 0; i < numElements; i++) next[(offsetOf(src[i]) >> (8 * b)) & 0xFF]++;
+			size_t cum = 0;
+			for (int iBucket = 0; iBucket < 0x100; iBucket++)
+			{
+				size_t count = next[iBucket];
+				next[iBucket] = cum;
+				cum += count;
+			}
+			perfMark("scatter", b);
+			bool construct = (dest == scratch && scratchLive < numElements);
+			for (size_t i = 0; i < numElements; i++)
+			{
+				T* slot = &dest[next[(offsetOf(src[i]) >> (8 * b)) & 0xFF]++];
+				if (construct) place(slot, src[i], std::true_type());
+				else place(slot, src[i], std::false_type());
+			}
+			if (construct) scratchLive = numElements;
+			std::swap(src, dest);
+		}
+		return true;
+	}
 
-		if (data == src)
+	// The last step of the counting sort in sortNarrow(): counts[d] elements have a key d above the smallest.
+	// Any type: a stable scatter into dest, from the start offsets.
+	void countingScatter(T*& src, T*& dest, T* scratch, size_t numElements, size_t* counts, size_t numCounts, size_t& scratchLive, std::false_type /*plain integer*/, uint64_t minKey, int shift)
+	{
+		size_t cum = 0;
+		for (size_t d = 0; d < numCounts; d++)
 		{
-			//delete [] dest;
+			size_t count = counts[d];
+			counts[d] = cum;
+			cum += count;
 		}
-		else if (data == dest)
+		bool construct = (dest == scratch && scratchLive < numElements);
+		for (size_t i = 0; i < numElements; i++)
 		{
-			//memcpy(data, src, numElements * sizeof(T));
-			mv(data, src, numElements);
-			//delete [] src;
+			T* slot = &dest[counts[(packedKey(src[i], getSize(src[i])) - minKey) >> shift]++];
+			if (construct) place(slot, src[i], std::true_type());
+			else place(slot, src[i], std::false_type());
 		}
-		else throw std::logic_error("Unknown buffer");
-		if (!keepMemoryResources) { free(); }
-	} // sortDirect()
+		if (construct) scratchLive = numElements;
+		std::swap(src, dest);
+	}
+	// Plain integers: the key is the whole value, so write each value count times, in place.
+	void countingScatter(T*& src, T*& /*dest*/, T* /*scratch*/, size_t /*numElements*/, size_t* counts, size_t numCounts, size_t& /*scratchLive*/, std::true_type /*plain integer*/, uint64_t minKey, int shift)
+	{
+		// Undo packedKey(): drop the padding, and flip the sign bit back
+		const uint64_t flip = signBit();
+		size_t pos = 0;
+		for (size_t d = 0; d < numCounts; d++)
+		{
+			if (!counts[d]) continue;
+			T value = (T)(((minKey >> shift) + d) ^ flip);
+			std::fill(src + pos, src + pos + counts[d], value);
+			pos += counts[d];
+		}
+	}
+
+	// For tiny ranges, clearing and summing 256 buckets every pass costs more than the elements
+	// themselves. Compares through the indexer, so any sortable type works. Equal keys end up in the
+	// same order as the radix passes leave them: input order, except negative floats, which the
+	// negative fix-up reverses. So an element that's a negative float goes in front of its equals.
+	void insertionSort(T* data, size_t numElements)
+	{
+		int numBytes = 0;
+		for (size_t i = 0; i < numElements; i++) numBytes = std::max(numBytes, (int)getSize(data[i]));
+		const bool floatNeg = (negativeOverride || std::is_signed<T>::value) && (floatOverride || std::is_floating_point<T>::value);
+		auto goesBefore = [&](const T& x, const T& y)
+		{
+			if (floatNeg && numBytes > 0 && (getByte(x, 0) & 0x80)) return !keyLess(y, x, numBytes);
+			return keyLess(x, y, numBytes);
+		};
+		for (size_t i = 1; i < numElements; i++)
+		{
+			if (!goesBefore(data[i], data[i - 1])) continue;
+			T x(std::move(data[i]));
+			size_t j = i;
+			do { data[j] = std::move(data[j - 1]); j--; } while (j > 0 && goesBefore(x, data[j - 1]));
+			data[j] = std::move(x);
+		}
+	}
+
+	// After the radix passes, negatives are at the end because the sign bit is most significant.
+	// Binary search for where they start.
+	// at(i) returns the i'th element in sorted order.
+	template <class At>
+	size_t findNegStart(size_t numElements, At at)
+	{
+		size_t negStart = numElements >> 1;
+		size_t negDelta = numElements >> 2;
+		while ((negStart > 0) && (negStart < numElements) && !(
+			(getByte(at(negStart), 0) & 0x80) != 0 && (getByte(at(negStart - 1), 0) & 0x80) == 0
+			))
+		{
+			if (getByte(at(negStart), 0) & 0x80) negStart -= negDelta;
+			else negStart += negDelta;
+			negDelta >>= 1;
+			if (negDelta < 1) negDelta = 1;
+		}
+		return negStart;
+	}
+
+	// Extra output for sortRange(): the start of every run of equal keys, and optionally
+	// only keep the first element of each run (compacted to the front of data).
+	struct RunOutput
+	{
+		size_t* starts; // room for numElements
+		size_t count;
+		bool compact;
+	};
+
+	// Moves the first element of each run to the front. Positions only go down, so in place is fine.
+	static void compactRuns(T* dest, T* src, const size_t* starts, size_t count)
+	{
+		for (size_t j = 0; j < count; j++)
+		{
+			if (dest + j != src + starts[j]) dest[j] = std::move(src[starts[j]]);
+		}
+	}
+
+	// The body of sort(), on any range. scratch is raw memory for at least numElements elements,
+	// and is raw again when this returns. Unless resultOut is given: then scratch holds numElements
+	// live elements too, nothing is copied back, and *resultOut is whichever of data and scratch
+	// has the result (or all the elements, if cancelled). Can run on several ranges at once, as long
+	// as the indexer and size functors don't mind being called from more than one thread, and each
+	// range gets its own room for sortNarrow()'s counts (see narrowCountsFor()).
+	// Returns false if cancelled; data then holds its original elements, in no particular order.
+	bool sortRange(T* data, T* scratch, size_t numElements, bool parallel, RunOutput* runs = nullptr, T** resultOut = nullptr, size_t* counts = nullptr)
+	{
+		if (resultOut) *resultOut = data;
+		if (cancelRequested()) return false;
+		if (numElements < smallSortThreshold)
+		{
+			perfMark("insertion sort");
+			insertionSort(data, numElements);
+			if (runs)
+			{
+				int numBytes = 0;
+				for (size_t i = 0; i < numElements; i++) numBytes = std::max(numBytes, (int)getSize(data[i]));
+				runs->count = 0;
+				for (size_t i = 0; i < numElements; i++)
+				{
+					if (i == 0 || !sameKey(data[i - 1], data[i], 0, numBytes)) runs->starts[runs->count++] = i;
+				}
+				if (runs->compact) compactRuns(data, data, runs->starts, runs->count);
+			}
+			perfMark(nullptr);
+			return true;
+		}
+		if (runs)
+		{
+			size_t words = (numElements + 63) >> 6;
+			if (runBitsWords < words)
+			{
+				if (runBits) delete[] runBits;
+				runBits = new unsigned long long[words];
+				runBitsWords = words;
+			}
+			memset(runBits, 0, words * sizeof(unsigned long long));
+		}
+		T* src = data;
+		T* dest = scratch;
+		size_t sortBufLive = resultOut ? numElements : 0; // how many leading elements of scratch have been constructed
+		bool cancelled = false;
+		bool narrowed = false; // sorted by sortNarrow(), in the final order already
+#ifndef RADIX_SORT_NO_THREADS
+		if (parallel && pool && poolTasks() > 1)
+		{
+			int maxBytes = 0;
+			cancelled = !radixPassesParallel(src, dest, scratch, numElements, sortBufLive, maxBytes);
+			if (runs && !cancelled)
+			{
+				if (maxBytes == 0) setBit(runBits, 0);
+				else markRunsParallel(src, numElements, maxBytes);
+			}
+		}
+		else
+#endif
+		{
+			size_t buckets[0x100];
+			int iByte; // sizeof(T);
+			int maxSize = 0;
+			// Keys of up to 8 bytes also get their smallest and biggest value in sort order on the way, for
+			// sortNarrow(). Not floats: their equal negatives come out of the usual passes in reverse order.
+			bool narrow = !runs && !(floatOverride || std::is_floating_point<T>::value);
+			uint64_t minKey = ~0ull, maxKey = 0;
+			perfMark("key sizes");
+			for (int i = 0; (size_t)i < numElements; i++)
+			{
+				int sz = getSize(data[i]);
+				if (sz > maxSize) maxSize = sz;
+				if (!narrow) continue;
+				if (sz > 8) { narrow = false; continue; }
+				uint64_t k = packedKey(data[i], sz);
+				if (k < minKey) minKey = k;
+				if (k > maxKey) maxKey = k;
+			}
+			narrowed = narrow && numElements > 0 && maxSize > 0 && sortNarrow(src, dest, scratch, numElements, maxSize, minKey, maxKey, sortBufLive, cancelled, counts);
+
+	 		iByte = narrowed ? 0 : maxSize;
+			while (iByte > 0)
+			{
+				if (cancelRequested()) { cancelled = true; break; }
+				iByte--;
+				perfMark("histogram", iByte);
+				memset(buckets, 0, sizeof(buckets));
+				for (size_t iData = 0; iData < numElements; iData++)
+				{
+					//buckets[(getByte(src[iData], iByte) >> (iByte << 3)) & 0xFF] ++;
+					buckets[getByte(src[iData], iByte)] ++;
+				}
+				size_t cum = 0; // cumulative total
+				for (int iBucket = 0; iBucket < 0x100; iBucket++)
+				{
+					cum += buckets[iBucket];
+					buckets[iBucket] = cum;
+
+				}
+
+				perfMark("scatter", iByte);
+				bool construct = (dest == scratch && sortBufLive < numElements);
+				if (runs && iByte == 0)
+				{
+					if (construct) scatterMarkRuns<true>(src, dest, numElements, buckets, maxSize, runBits);
+					else scatterMarkRuns<false>(src, dest, numElements, buckets, maxSize, runBits);
+				}
+				else if (construct) scatter<true>(src, dest, numElements, iByte, buckets);
+				else scatter<false>(src, dest, numElements, iByte, buckets);
+				if (construct) sortBufLive = numElements;
+				std::swap(src, dest);
+			} // iByte
+			if (runs && maxSize == 0 && numElements > 0) setBit(runBits, 0); // no bytes at all, so all equal
+		}
+
+		size_t negStart = numElements; // where the negatives started before being moved to the front
+		bool negReversed = false;
+
+
+		if (!cancelled && !narrowed && (negativeOverride || std::is_signed<T>::value))
+		{
+			// Move negative numbers to the beginning of the array and reverse order
+			// At this point, they will be at the end, because sign bit is most significant
+			// First, binary search for start of negatives.
+			perfMark("negatives");
+			negStart = findNegStart(numElements, [src](size_t i) -> const T& { return src[i]; });
+			size_t negCount = numElements - negStart;
+			if (negStart < numElements)
+			{
+				//memcpy(dest, src + negStart, negCount * sizeof(T));
+				//memmove(src + negCount, src, negStart * sizeof(T));
+				//memcpy(src, dest, negCount * sizeof(T));
+
+				if (dest == scratch && sortBufLive < negCount)
+				{
+					// Only happens if there were no passes, so nothing is in scratch yet.
+					mvConstruct(dest, src + negStart, negCount);
+					sortBufLive = negCount;
+				}
+				else mv(dest, src + negStart, negCount);
+				mv(src + negCount, src, negStart);
+				mv(src, dest, negCount);
+
+				//std::swap(src, dest);
+				if (floatOverride || std::is_floating_point<T>::value)
+				{
+					// Integer wrap-around/overflow of negative numbers preserves order here, but
+					// floating point types will be reversed, because the binary value is the same
+					// whether positive or negative, except the sign bit.
+					// Basically floats are backwards.
+					size_t negSwapLo = 0;
+					size_t negSwapHi = negCount - 1;
+					while (negSwapLo < negSwapHi) std::swap(src[negSwapLo++], src[negSwapHi--]);
+					negReversed = true;
+				}
+			}
+			else negStart = numElements;
+		} // if negatives
+
+		if (runs && !cancelled) runs->count = collectRuns(runs->starts, numElements, negStart, negReversed);
+		bool compact = (runs && !cancelled && runs->compact);
+
+		if (resultOut)
+		{
+			*resultOut = src;
+			perfMark(nullptr);
+			return !cancelled;
+		}
+		if (data == src)
+		{
+			//delete [] dest;
+			if (compact) compactRuns(data, data, runs->starts, runs->count);
+		}
+		else if (data == dest)
+		{
+			perfMark("copy back");
+			//memcpy(data, src, numElements * sizeof(T));
+			// If we're only keeping one element per run, the copy back is also the dedupe
+			if (compact) compactRuns(data, src, runs->starts, runs->count);
+			else mv(data, src, numElements);
+			//delete [] src;
+		}
+		else throw std::logic_error("Unknown buffer");
+		// Whatever is left in scratch has been moved from. Destroy it so the buffer is raw again.
+		destroy(scratch, sortBufLive);
+		perfMark(nullptr);
+		return !cancelled;
+	} // sortRange()
+
+public:
+	void sort(T* data, size_t numElements, bool keepMemoryResources = false) //, M T::* value, bool hasNegative)
+	{
+		tuneFor(numElements);
+		bool ok;
+		int keyBytes = indirectKeyBytes(data, numElements);
+		if (keyBytes >= 0) ok = sortIndirect(data, numElements, keyBytes);
+		else
+		{
+			growAllocSort(numElements);
+			bool parallel = false;
+#ifndef RADIX_SORT_NO_THREADS
+			parallel = (numElements >= parallelThreshold);
+#endif
+			ok = sortRange(data, sortBuf, numElements, parallel);
+		}
+		if (!keepMemoryResources && !keepMemory) { free(); }
+		if (!ok) throw SortCancelled();
+	} // sortDirect()
+
+private:
+	// A big element's key for sortIndirect(), packed into an integer with byte 0 on top, so integer
+	// order is the order of the radix passes (before the negative fix-up), and where the element was.
+	template <typename K, typename Idx>
+	struct Tag
+	{
+		K key;
+		Idx idx;
+	};
+
+	// How many key bytes sortIndirect() has to pack, or -1 if sort() should move the elements themselves:
+	// they're small, the array is small, some key doesn't fit in 8 bytes, or the pool would sort them
+	// (sortIndirect() is single threaded, and the pool's passes beat it).
+	int indirectKeyBytes(const T* data, size_t numElements)
+	{
+		if (!indirectBytes || sizeof(T) < indirectBytes || numElements < smallSortThreshold) return -1;
+#ifndef RADIX_SORT_NO_THREADS
+		if (pool && poolTasks() > 1 && numElements >= parallelThreshold) return -1;
+#endif
+		int numBytes = 0;
+		for (size_t i = 0; i < numElements; i++) numBytes = std::max(numBytes, (int)getSize(data[i]));
+		return (numBytes <= 8) ? numBytes : -1;
+	}
+
+	// sortIndirect() with the narrowest tags that fit
+	bool sortIndirect(T* data, size_t numElements, int numBytes)
+	{
+		bool small = ((unsigned long long)numElements <= 0xFFFFFFFFull);
+		if (numBytes <= 4) return small ? sortIndirect<uint32_t, uint32_t>(data, numElements, numBytes) : sortIndirect<uint32_t, size_t>(data, numElements, numBytes);
+		return small ? sortIndirect<uint64_t, uint32_t>(data, numElements, numBytes) : sortIndirect<uint64_t, size_t>(data, numElements, numBytes);
+	}
+
+	// sort() for big elements. Every pass of sortRange() would move whole elements, and it needs a
+	// second array of them. Instead, radix sort (key, index) tags in idxBuf, then move each element
+	// straight to where it belongs by following the cycles of the permutation, holding one element
+	// aside per cycle. The keys are in the tags, so the passes never touch the elements, and all the
+	// histograms come out of the one read of the elements that builds the tags. Same order as sortRange(),
+	// ties and negatives included. On the calling thread only, so not used when the pool would
+	// sort the array. Returns false (data untouched) if cancelled.
+	template <typename K, typename Idx>
+	bool sortIndirect(T* data, size_t numElements, int numBytes)
+	{
+		typedef Tag<K, Idx> TagT;
+		if (numBytes == 0 || numElements < 2) return true;
+		perfMark("tags");
+		growIdxBuf(2 * numElements * sizeof(TagT));
+		TagT* src = (TagT*)idxBuf;
+		TagT* dest = src + numElements;
+		size_t buckets[8][0x100];
+		memset(buckets, 0, numBytes * sizeof(buckets[0]));
+		for (size_t i = 0; i < numElements; i++)
+		{
+			K key = 0;
+			for (int b = 0; b < numBytes; b++)
+			{
+				unsigned char c = getByte(data[i], b);
+				buckets[b][c]++;
+				key = (key << 8) | c;
+			}
+			src[i].key = key;
+			src[i].idx = (Idx)i;
+		}
+
+		for (int b = numBytes - 1; b >= 0; b--)
+		{
+			if (cancelRequested()) { perfMark(nullptr); return false; }
+			int shift = (numBytes - 1 - b) * 8;
+			size_t* bucket = buckets[b];
+			if (bucket[(src[0].key >> shift) & 0xFF] == numElements) continue; // all the same byte, nothing would move
+			perfMark("scatter", b);
+			size_t cum = 0;
+			for (int iBucket = 0; iBucket < 0x100; iBucket++)
+			{
+				size_t count = bucket[iBucket];
+				bucket[iBucket] = cum;
+				cum += count;
+			}
+			for (size_t i = 0; i < numElements; i++) dest[bucket[(src[i].key >> shift) & 0xFF]++] = src[i];
+			std::swap(src, dest);
+		}
+
+		if (negativeOverride || std::is_signed<T>::value)
+		{
+			perfMark("negatives");
+			const K sign = (K)0x80 << ((numBytes - 1) * 8);
+			TagT* neg = std::partition_point(src, src + numElements, [sign](const TagT& t) { return !(t.key & sign); });
+			size_t negCount = (src + numElements) - neg;
+			std::rotate(src, neg, src + numElements);
+			if (floatOverride || std::is_floating_point<T>::value) std::reverse(src, src + negCount);
+		}
+
+		// src[i].idx is the element that belongs at i. Mark each spot done (idx = i) as it's filled.
+		perfMark("permute");
+		for (size_t i = 0; i < numElements; i++)
+		{
+			if (src[i].idx == i) continue;
+			T hold(std::move(data[i]));
+			size_t j = i;
+			for (;;)
+			{
+				size_t from = src[j].idx;
+				src[j].idx = (Idx)j;
+				if (from == i)
+				{
+					data[j] = std::move(hold);
+					break;
+				}
+				data[j] = std::move(data[from]);
+				j = from;
+			}
+		}
+		perfMark(nullptr);
+		return true;
+	}
+
+public:
+	// sort() without the copy back at the end. data and other both hold numElements live elements, and the
+	// radix passes go back and forth between them. Returns whichever one has the sorted elements; the other
+	// is left with moved-from leftovers, ready to be the other buffer next time. If cancelled, the one
+	// returned would have been the one with all the elements, but SortCancelled is thrown instead.
+	T* sortEither(T* data, T* other, size_t numElements, bool keepMemoryResources = false)
+	{
+		T* result;
+		bool ok = sortEitherRange(data, other, numElements, result);
+		if (!keepMemoryResources && !keepMemory) { free(); }
+		if (!ok) throw SortCancelled();
+		return result;
+	}
+
+	// sortEither() for vectors: if the result ends up in spare, the vectors are swapped instead of copied,
+	// so data always ends up sorted, maybe in what was spare's storage. spare is resized to data.size()
+	// (which needs a default constructor when it grows), so pass the same one every time.
+	void sort(std::vector<T>& data, std::vector<T>& spare, bool keepMemoryResources = false)
+	{
+		spare.resize(data.size());
+		T* result;
+		bool ok = sortEitherRange(data.data(), spare.data(), data.size(), result);
+		if (result != data.data()) data.swap(spare);
+		if (!keepMemoryResources && !keepMemory) { free(); }
+		if (!ok) throw SortCancelled();
+	}
+
+	// The same with a spare vector that belongs to this Sorter. It's kept between calls with
+	// keepMemoryResources (or Tuning::keepMemory), otherwise free() drops it after each call.
+	void sort(std::vector<T>& data, bool keepMemoryResources = false)
+	{
+		std::vector<T> mine;
+		mine.swap(spare); // so a free() on the way out can't pull it out from under us
+		try { sort(data, mine, true); }
+		catch (...) { mine.swap(spare); throw; }
+		mine.swap(spare);
+		if (!keepMemoryResources && !keepMemory) { free(); }
+	}
+
+private:
+	// The body of sortEither(). Big elements (see Tuning::indirectBytes) are sorted in data through tags and never touch other.
+	bool sortEitherRange(T* data, T* other, size_t numElements, T*& result)
+	{
+		tuneFor(numElements);
+		result = data;
+		int keyBytes = indirectKeyBytes(data, numElements);
+		if (keyBytes >= 0) return sortIndirect(data, numElements, keyBytes);
+		bool parallel = false;
+#ifndef RADIX_SORT_NO_THREADS
+		parallel = (numElements >= parallelThreshold);
+#endif
+		return sortRange(data, other, numElements, parallel, nullptr, &result);
+	}
+
+public:
+	// Sorts each segment data[offsets[s], offsets[s + 1]) on its own, for every s in [0, numSegments).
+	// offsets has numSegments + 1 entries, in increasing order. Scratch space is sized once for the
+	// biggest segment and reused, so it stays in cache, and tiny segments get an insertion sort instead
+	// of the radix passes. With a thread pool, segments of at least parallelThreshold elements get the
+	// whole pool one at a time, and the rest are handed out to the pool's tasks a block at a time,
+	// each task with its own slice of scratch.
+	void sortSegments(T* data, const size_t* offsets, size_t numSegments, bool keepMemoryResources = false)
+	{
+		if (numSegments == 0) return;
+		tuneFor(offsets[numSegments] - offsets[0]);
+		size_t maxSmall = 0, maxBig = 0;
+		for (size_t s = 0; s < numSegments; s++)
+		{
+			size_t len = offsets[s + 1] - offsets[s];
+#ifndef RADIX_SORT_NO_THREADS
+			if (pool && len >= parallelThreshold) { maxBig = std::max(maxBig, len); continue; }
+#endif
+			maxSmall = std::max(maxSmall, len);
+		}
+		bool cancelled = false;
+#ifndef RADIX_SORT_NO_THREADS
+		if (pool && poolTasks() > 1 && offsets[numSegments] - offsets[0] >= parallelThreshold)
+		{
+			unsigned nTasks = poolTasks();
+			growAllocSort(std::max(maxBig, maxSmall * nTasks));
+			const size_t countsPerTask = narrowCountsFor(maxSmall);
+			growNarrowCounts(countsPerTask * nTasks);
+			for (size_t s = 0; s < numSegments && !cancelled; s++)
+			{
+				size_t lo = offsets[s], hi = offsets[s + 1];
+				if (hi - lo >= parallelThreshold) cancelled = !sortRange(data + lo, sortBuf, hi - lo, true);
+			}
+
+			std::atomic<size_t> next(0);
+			std::atomic<bool> stop(cancelled);
+			const size_t block = 16; // segments per grab, so small segments don't all fight over next
+			auto segmentJob = [&](unsigned t)
+			{
+				T* scratch = sortBuf + maxSmall * t;
+				size_t* counts = narrowCounts + countsPerTask * t;
+				for (;;)
+				{
+					size_t first = next.fetch_add(block);
+					if (first >= numSegments) return;
+					size_t last = std::min(numSegments, first + block);
+					for (size_t s = first; s < last; s++)
+					{
+						if (stop.load(std::memory_order_relaxed)) return;
+						size_t lo = offsets[s], hi = offsets[s + 1];
+						if (hi - lo >= parallelThreshold) continue; // already done above
+						if (!sortRange(data + lo, scratch, hi - lo, false, nullptr, nullptr, counts)) stop = true;
+					}
+				}
+			};
+			if (!cancelled) pool->run(nTasks, segmentJob);
+			cancelled = stop;
+		}
+		else
+#endif
+		{
+			growAllocSort(std::max(maxSmall, maxBig));
+			for (size_t s = 0; s < numSegments && !cancelled; s++)
+			{
+				size_t lo = offsets[s], hi = offsets[s + 1];
+				cancelled = !sortRange(data + lo, sortBuf, hi - lo, false);
+			}
+		}
+		if (!keepMemoryResources && !keepMemory) { free(); }
+		if (cancelled) throw SortCancelled();
+	}
+
+	// Splits data into 2^bits partitions by the top bits of the key, in sort order (negatives first), with one
+	// histogram and one scatter pass and no sorting inside the partitions. Partition p ends up in
+	// data[offsetsOut[p], offsetsOut[p + 1]), its elements in input order. offsetsOut needs 2^bits + 1 entries,
+	// the layout sortSegments() takes, so partition() then sortSegments() is a full sort, done one cache-sized
+	// piece at a time. bits is 1 to 16. Big arrays are split across the pool, if there is one, like sort()'s passes.
+	void partition(T* data, size_t numElements, int bits, size_t* offsetsOut, bool keepMemoryResources = false)
+	{
+		checkPartitionBits(bits);
+		tuneFor(numElements);
+		growAllocSort(numElements);
+		bool ok = partitionRange(data, sortBuf, numElements, bits, offsetsOut, true);
+		if (ok)
+		{
+			perfMark("copy back");
+			mv(data, sortBuf, numElements);
+			destroy(sortBuf, numElements);
+			perfMark(nullptr);
+		}
+		if (!keepMemoryResources && !keepMemory) { free(); }
+		if (!ok) throw SortCancelled();
+	}
+
+	// partition() from src into dest, which must hold numElements live elements to be assigned over.
+	// Needs no scratch memory and has no copy back. src is left with moved-from elements.
+	void partitionInto(T* src, T* dest, size_t numElements, int bits, size_t* offsetsOut)
+	{
+		checkPartitionBits(bits);
+		tuneFor(numElements);
+		if (!partitionRange(src, dest, numElements, bits, offsetsOut, false)) throw SortCancelled();
+	}
+
+private:
+	static void checkPartitionBits(int bits)
+	{
+		if (bits < 1 || bits > 16) throw std::invalid_argument("partition(): bits must be from 1 to 16.");
+	}
+
+	// The partition x goes to: the top bits of its key, in sort order
+	size_t partitionOf(const T& x, int bits)
+	{
+		size_t top = orderedByte(x, 0);
+		if (bits <= 8) return top >> (8 - bits);
+		top = (top << 8) | orderedByte(x, 1);
+		return top >> (16 - bits);
+	}
+
+	// The body of partition(). construct = dest is raw memory. Returns false if cancelled, before anything moved.
+	bool partitionRange(T* src, T* dest, size_t numElements, int bits, size_t* offsets, bool construct)
+	{
+		if (cancelRequested()) return false;
+		size_t numParts = (size_t)1 << bits;
+#ifndef RADIX_SORT_NO_THREADS
+		if (pool && poolTasks() > 1 && numElements >= parallelThreshold)
+		{
+			partitionParallel(src, dest, numElements, bits, offsets, construct);
+			return true;
+		}
+#endif
+		perfMark("histogram");
+		std::fill(offsets, offsets + numParts + 1, (size_t)0);
+		for (size_t i = 0; i < numElements; i++) offsets[partitionOf(src[i], bits)]++;
+		size_t cum = 0;
+		for (size_t p = 0; p <= numParts; p++)
+		{
+			size_t count = offsets[p];
+			offsets[p] = cum;
+			cum += count;
+		}
+		perfMark("scatter");
+		std::vector<size_t> next(offsets, offsets + numParts);
+		scatterPartitions(src, dest, 0, numElements, bits, next.data(), construct);
+		perfMark(nullptr);
+		return true;
+	}
+
+#ifndef RADIX_SORT_NO_THREADS
+	// partitionRange() on the pool: each task histograms its slice, the counts are summed partition
+	// major then task, and each task scatters its slice from its own start offsets. Still stable.
+	void partitionParallel(T* src, T* dest, size_t numElements, int bits, size_t* offsets, bool construct)
+	{
+		unsigned nTasks = poolTasks();
+		size_t numParts = (size_t)1 << bits;
+		std::vector<size_t> counts(numParts * nTasks, 0);
+		size_t slice = (numElements + nTasks - 1) / nTasks;
+		auto sliceLo = [&](unsigned t) { return std::min(numElements, slice * t); };
+		auto sliceHi = [&](unsigned t) { return std::min(numElements, slice * (t + 1)); };
+
+		perfMark("histogram");
+		auto histJob = [&](unsigned t)
+		{
+			size_t* c = counts.data() + numParts * t;
+			for (size_t i = sliceLo(t); i < sliceHi(t); i++) c[partitionOf(src[i], bits)]++;
+		};
+		pool->run(nTasks, histJob);
+		size_t cum = 0;
+		for (size_t p = 0; p < numParts; p++)
+		{
+			offsets[p] = cum;
+			for (unsigned t = 0; t < nTasks; t++)
+			{
+				size_t c = counts[numParts * t + p];
+				counts[numParts * t + p] = cum;
+				cum += c;
+			}
+		}
+		offsets[numParts] = cum;
+
+		perfMark("scatter");
+		auto scatterJob = [&](unsigned t) { scatterPartitions(src, dest, sliceLo(t), sliceHi(t), bits, counts.data() + numParts * t, construct); };
+		pool->run(nTasks, scatterJob);
+		perfMark(nullptr);
+	}
+#endif
+
+	// Moves src[lo, hi) to dest, each element to next[its partition]++. Small trivially copyable
+	// elements go through write-combining buffers, everything else is moved one at a time.
+	void scatterPartitions(T* src, T* dest, size_t lo, size_t hi, int bits, size_t* next, bool construct)
+	{
+		scatterPartitions(src, dest, lo, hi, bits, next, construct, std::integral_constant<bool, std::is_trivially_copyable<T>::value && sizeof(T) <= 16>());
+	}
+	void scatterPartitions(T* src, T* dest, size_t lo, size_t hi, int bits, size_t* next, bool construct, std::false_type /*write-combine*/)
+	{
+		for (size_t i = lo; i < hi; i++)
+		{
+			T* slot = &dest[next[partitionOf(src[i], bits)]++];
+			if (construct) place(slot, src[i], std::true_type());
+			else place(slot, src[i], std::false_type());
+		}
+	}
+	// With many partitions, writing each element straight to its partition keeps that many output
+	// streams open, more than the cache and TLB can hold. Instead, each partition fills a cache line
+	// sized buffer first, lined up with where its elements go in dest, and goes out a whole line at
+	// a time, with non-temporal stores when the line is full. memcpy makes it fine for raw dest too.
+	void scatterPartitions(T* src, T* dest, size_t lo, size_t hi, int bits, size_t* next, bool construct, std::true_type /*write-combine*/)
+	{
+		const size_t perLine = CACHE_LINE_SIZE / sizeof(T);
+		if (bits < RADIX_SORT_WRITE_COMBINE_BITS || CACHE_LINE_SIZE % sizeof(T) || (uintptr_t)dest % sizeof(T))
+		{
+			scatterPartitions(src, dest, lo, hi, bits, next, construct, std::false_type());
+			return;
+		}
+		size_t numParts = (size_t)1 << bits;
+		std::vector<char> raw((numParts + 1) * CACHE_LINE_SIZE);
+		char* lines = raw.data() + (CACHE_LINE_SIZE - (uintptr_t)raw.data() % CACHE_LINE_SIZE) % CACHE_LINE_SIZE;
+		// Slots [start, fill) of a partition's line hold elements for dest[next, ...)
+		std::vector<unsigned char> start(numParts), fill(numParts);
+		for (size_t p = 0; p < numParts; p++) start[p] = fill[p] = (unsigned char)(((uintptr_t)(dest + next[p]) % CACHE_LINE_SIZE) / sizeof(T));
+		for (size_t i = lo; i < hi; i++)
+		{
+			size_t p = partitionOf(src[i], bits);
+			char* line = lines + p * CACHE_LINE_SIZE;
+			memcpy(line + fill[p] * sizeof(T), &src[i], sizeof(T));
+			if (++fill[p] == perLine)
+			{
+				if (start[p] == 0) streamLine(&dest[next[p]], line);
+				else memcpy(&dest[next[p]], line + start[p] * sizeof(T), (perLine - start[p]) * sizeof(T));
+				next[p] += perLine - start[p];
+				fill[p] = start[p] = 0;
+			}
+		}
+		for (size_t p = 0; p < numParts; p++)
+		{
+			if (fill[p] == start[p]) continue;
+			memcpy(&dest[next[p]], lines + p * CACHE_LINE_SIZE + start[p] * sizeof(T), (fill[p] - start[p]) * sizeof(T));
+			next[p] += fill[p] - start[p];
+		}
+#ifndef RADIX_SORT_NO_MMINTRIN
+		_mm_sfence(); // the streamed lines have to be out before another thread reads dest
+#endif
+	}
+
+	// Writes one aligned cache line around the cache, since it won't be read again soon
+	static void streamLine(void* dest, const char* line)
+	{
+#ifndef RADIX_SORT_NO_MMINTRIN
+		for (int i = 0; i < CACHE_LINE_SIZE; i += 16) _mm_stream_ps((float*)((char*)dest + i), _mm_load_ps((const float*)(line + i)));
+#else
+		memcpy(dest, line, CACHE_LINE_SIZE);
+#endif
+	}
+
+public:
+	// sort(), and also find where each run of equal keys starts (GROUP BY boundaries).
+	// runStartsOut needs room for numElements entries. Returns the number of runs.
+	// Equal means the indexer returns the same bytes, so e.g. -0.0f and 0.0f are different keys.
+	size_t sortRuns(T* data, size_t numElements, size_t* runStartsOut, bool keepMemoryResources = false)
+	{
+		RunOutput runs = { runStartsOut, 0, false };
+		sortWithRuns(data, numElements, runs, keepMemoryResources);
+		return runs.count;
+	}
+
+	// sort(), then keep only the first element of each run of equal keys, like std::unique().
+	// Returns the number of unique keys. Elements after that have been moved from.
+	size_t sortUnique(T* data, size_t numElements, bool keepMemoryResources = false)
+	{
+		growIdxBuf(numElements * sizeof(size_t)); // sortWithRuns() doesn't use idxBuf, so it can hold the run starts
+		RunOutput runs = { (size_t*)idxBuf, 0, true };
+		sortWithRuns(data, numElements, runs, keepMemoryResources);
+		return runs.count;
+	}
+
+	// sortUnique(), plus how many times each unique key appeared (COUNT ... GROUP BY).
+	// countsOut needs room for numElements entries. Returns the number of unique keys.
+	size_t sortCount(T* data, size_t numElements, size_t* countsOut, bool keepMemoryResources = false)
+	{
+		RunOutput runs = { countsOut, 0, true };
+		sortWithRuns(data, numElements, runs, keepMemoryResources);
+		// Starts -> counts, in place
+		for (size_t j = 0; j < runs.count; j++)
+		{
+			size_t next = (j + 1 < runs.count) ? countsOut[j + 1] : numElements;
+			countsOut[j] = next - countsOut[j];
+		}
+		return runs.count;
+	}
+
+private:
+	void sortWithRuns(T* data, size_t numElements, RunOutput& runs, bool keepMemoryResources)
+	{
+		tuneFor(numElements);
+		growAllocSort(numElements);
+		bool parallel = false;
+#ifndef RADIX_SORT_NO_THREADS
+		parallel = (numElements >= parallelThreshold);
+#endif
+		bool ok = sortRange(data, sortBuf, numElements, parallel, &runs);
+		if (!keepMemoryResources && !keepMemory) { free(); }
+		if (!ok) throw SortCancelled();
+	}
+
+public:
+	// A column of a table stored column-wise: numElements values of elemSize bytes each.
+	// Values are moved with memcpy, so they must be trivially copyable.
+	struct Column
+	{
+		void* data;
+		size_t elemSize;
+	};
+
+	// Sorts keys and puts every column in the same order, as if each row had been sorted whole.
+	// The key's original index rides along through the radix passes (no view(), so no random reads
+	// of the keys), which run on the pool like sort()'s from the parallel threshold up. Then each column
+	// is gathered through that permutation into one shared scratch buffer, prefetching the row 16 ahead,
+	// and copied back. Both steps are split into slices across the pool if there is one.
+	void sortColumns(T* keys, size_t numElements, const Column* columns, size_t numColumns, bool keepMemoryResources = false)
+	{
+		tuneFor(numElements);
+		if ((unsigned long long)numElements <= 0xFFFFFFFFull) sortColumnsWith<uint32_t>(keys, numElements, columns, numColumns);
+		else sortColumnsWith<size_t>(keys, numElements, columns, numColumns);
+		if (!keepMemoryResources && !keepMemory) { free(); }
+	}
+
+private:
+	template <typename Idx>
+	void sortColumnsWith(T* keys, size_t numElements, const Column* columns, size_t numColumns)
+	{
+		const Idx* perm = sortWithIndex<Idx>(keys, numElements);
+		size_t maxBytes = 0;
+		for (size_t c = 0; c < numColumns; c++) maxBytes = std::max(maxBytes, columns[c].elemSize * numElements);
+		if (colBufSize < maxBytes)
+		{
+			if (colBuf) delete[] colBuf;
+			colBuf = new char[maxBytes];
+			colBufSize = maxBytes;
+		}
+
+		unsigned nTasks = 1;
+#ifndef RADIX_SORT_NO_THREADS
+		if (pool && numElements >= parallelThreshold) nTasks = poolTasks();
+#endif
+		size_t slice = (numElements + nTasks - 1) / nTasks;
+		for (size_t c = 0; c < numColumns; c++)
+		{
+			const Column col = columns[c];
+			auto gatherJob = [&](unsigned t)
+			{
+				size_t lo = std::min(numElements, slice * t), hi = std::min(numElements, slice * (t + 1));
+				gatherColumn(colBuf, (const char*)col.data, col.elemSize, perm, lo, hi);
+			};
+			auto copyBackJob = [&](unsigned t)
+			{
+				size_t lo = std::min(numElements, slice * t), hi = std::min(numElements, slice * (t + 1));
+				memcpy((char*)col.data + lo * col.elemSize, colBuf + lo * col.elemSize, (hi - lo) * col.elemSize);
+			};
+#ifndef RADIX_SORT_NO_THREADS
+			if (nTasks > 1)
+			{
+				pool->run(nTasks, gatherJob);
+				pool->run(nTasks, copyBackJob);
+				continue;
+			}
+#endif
+			gatherJob(0);
+			copyBackJob(0);
+		}
+	}
+
+	// Radix passes that move the keys and carry each key's original index with it, in idxBuf.
+	// Leaves the keys sorted in data and returns the buffer holding the indices.
+	template <typename Idx>
+	Idx* sortWithIndex(T* data, size_t numElements)
+	{
+		growIdxBuf(2 * numElements * sizeof(Idx));
+		growAllocSort(numElements);
+		T* src = data;
+		T* dest = sortBuf;
+		Idx* isrc = (Idx*)idxBuf;
+		Idx* idest = isrc + numElements;
+		size_t sortBufLive = 0;
+		int maxBytes = 0;
+		auto cancel = [&]
+		{
+			if (src != data) mv(data, src, numElements);
+			destroy(sortBuf, sortBufLive);
+			throw SortCancelled();
+		};
+#ifndef RADIX_SORT_NO_THREADS
+		if (pool && numElements >= parallelThreshold)
+		{
+			unsigned nTasks = poolTasks();
+			size_t slice = (numElements + nTasks - 1) / nTasks;
+			auto iotaJob = [&](unsigned t)
+			{
+				size_t hi = std::min(numElements, slice * (t + 1));
+				for (size_t i = std::min(numElements, slice * t); i < hi; i++) isrc[i] = (Idx)i;
+			};
+			pool->run(nTasks, iotaJob);
+			if (!radixPassesParallel(src, dest, sortBuf, numElements, sortBufLive, maxBytes, isrc, idest)) cancel();
+		}
+		else
+#endif
+		{
+			for (size_t i = 0; i < numElements; i++)
+			{
+				isrc[i] = (Idx)i;
+				maxBytes = std::max(maxBytes, (int)getSize(data[i]));
+			}
+
+			size_t buckets[0x100];
+			for (int iByte = maxBytes - 1; iByte >= 0; iByte--)
+			{
+				if (cancelRequested()) cancel();
+				memset(buckets, 0, sizeof(buckets));
+				for (size_t i = 0; i < numElements; i++) buckets[getByte(src[i], iByte)]++;
+				size_t cum = 0;
+				for (int b = 0; b < 0x100; b++) { cum += buckets[b]; buckets[b] = cum; }
+
+				bool construct = (dest == sortBuf && sortBufLive < numElements);
+				size_t i = numElements;
+				while (i > 0)
+				{
+					i--;
+					size_t pos = --buckets[getByte(src[i], iByte)];
+					if (construct) place(&dest[pos], src[i], std::true_type());
+					else place(&dest[pos], src[i], std::false_type());
+					idest[pos] = isrc[i];
+				}
+				if (construct) sortBufLive = numElements;
+				std::swap(src, dest);
+				std::swap(isrc, idest);
+			}
+		}
+
+		if (negativeOverride || std::is_signed<T>::value)
+		{
+			size_t negStart = findNegStart(numElements, [src](size_t i) -> const T& { return src[i]; });
+			if (negStart < numElements)
+			{
+				std::rotate(src, src + negStart, src + numElements);
+				std::rotate(isrc, isrc + negStart, isrc + numElements);
+				if (floatOverride || std::is_floating_point<T>::value)
+				{
+					std::reverse(src, src + (numElements - negStart));
+					std::reverse(isrc, isrc + (numElements - negStart));
+				}
+			}
+		}
+		if (src != data) mv(data, src, numElements);
+		destroy(sortBuf, sortBufLive);
+		return isrc;
+	}
+
+	// out[r] = in[perm[r]] for rows [lo, hi). Fixed size memcpy compiles to a plain load/store
+	// for the usual column widths, without breaking aliasing rules.
+	template <size_t N, typename Idx>
+	static void gatherFixed(char* out, const char* in, const Idx* perm, size_t lo, size_t hi, size_t elemSize = N)
+	{
+		const size_t ahead = 16; // how far ahead to prefetch the random reads
+		for (size_t r = lo; r < hi; r++)
+		{
+#ifndef RADIX_SORT_NO_MMINTRIN
+			if (r + ahead < hi) RADIX_SORT_PREFETCH(in + (size_t)perm[r + ahead] * elemSize);
+#endif
+			memcpy(out + r * elemSize, in + (size_t)perm[r] * elemSize, N ? N : elemSize);
+		}
+	}
+
+	template <typename Idx>
+	static void gatherColumn(char* out, const char* in, size_t elemSize, const Idx* perm, size_t lo, size_t hi)
+	{
+		switch (elemSize)
+		{
+		case 1: gatherFixed<1>(out, in, perm, lo, hi); break;
+		case 2: gatherFixed<2>(out, in, perm, lo, hi); break;
+		case 4: gatherFixed<4>(out, in, perm, lo, hi); break;
+		case 8: gatherFixed<8>(out, in, perm, lo, hi); break;
+		case 16: gatherFixed<16>(out, in, perm, lo, hi); break;
+		default: gatherFixed<0>(out, in, perm, lo, hi, elemSize); break;
+		}
+	}
+
+public:
+	// Byte i of x, changed so that comparing these bytes as unsigned, from byte 0 on, gives the order
+	// sort() ends up with, negatives included. For splitting keys into ranges before sorting them.
+	unsigned char orderedByte(const T& x, int i)
+	{
+		unsigned char b = getByte(x, i);
+		if (!(negativeOverride || std::is_signed<T>::value)) return b;
+		if (floatOverride || std::is_floating_point<T>::value)
+		{
+			// Negative: flip every bit. Positive: just the sign bit. No branch on the sign, it's random.
+			unsigned char neg = (unsigned char)(0 - (getByte(x, 0) >> 7));
+			return (unsigned char)(b ^ (neg | (i == 0 ? 0x80 : 0)));
+		}
+		return (i == 0) ? (unsigned char)(b ^ 0x80) : b;
+	}
+	// True if sort() puts a before b, and their keys aren't equal.
+	bool comesBefore(const T& a, const T& b) { return keyLess(a, b, std::max((int)getSize(a), (int)getSize(b))); }
+
+	// Below this many elements sort() (and each segment of sortSegments()) uses an insertion sort. Wins over a profile.
+	void setSmallSortThreshold(size_t numElements) { smallSortThreshold = numElements; pinned |= PinSmallSort; }
+	size_t getSmallSortThreshold() const { return smallSortThreshold; }
+
+	// All of the per-call settings at once. A profile (setProfile()) overrides them on every call,
+	// except the ones set with setSmallSortThreshold(), setParallelThreshold() and useThreads().
+	void setTuning(const Tuning& t) { applyTuning(t, 0); }
+	Tuning getTuning() const
+	{
+		Tuning t;
+		t.smallSortThreshold = smallSortThreshold;
+		t.prefetchBytes = prefetchInterval * sizeof(T);
+		t.keepMemory = keepMemory;
+		t.indirectBytes = indirectBytes;
+#ifndef RADIX_SORT_NO_THREADS
+		t.parallelThreshold = parallelThreshold;
+		t.threads = maxTasks;
+#endif
+		return t;
+	}
+
+	// How this Sorter's element type is named in a Profile: f = floating point, i = signed integer,
+	// u = unsigned integer, o = anything else, then sizeof(T). The Sorter(-1) and Sorter(-1.0)
+	// constructors count as i and f.
+	std::string profileKey() const
+	{
+		const char* kind = "o";
+		if (floatOverride || std::is_floating_point<T>::value) kind = "f";
+		else if (negativeOverride || std::is_signed<T>::value) kind = "i";
+		else if (std::is_integral<T>::value) kind = "u";
+		return kind + std::to_string(sizeof(T));
+	}
+
+	// From now on each call uses the profile's settings for its array size. The entries are copied,
+	// so the Profile doesn't have to stay around. Sorters start with Profile::global(), if there is one.
+	void setProfile(const Profile& profile) { setProfile(profile, profileKey()); }
+	void setProfile(const Profile& profile, const std::string& type)
+	{
+		tuning.clear();
+		for (auto& e : profile.entriesFor(type)) tuning.push_back(std::make_pair(e.minSize, e.tuning));
+	}
+	// Back to the settings from setTuning() and friends. The last profile settings used stay in effect until changed.
+	void clearProfile() { tuning.clear(); }
+
+	// Times the candidate settings on this machine with arrays like sample and adds the winners to
+	// profile, under profileKey(), one entry per size class (powers of 4 from 16 up to sampleSize).
+	// Every trial sorts fresh copies of the start of sample, so T must be copyable, and the sample
+	// should look like the real data. With a big sample this takes a while; do it once and save() it.
+	void calibrate(Profile& profile, const T* sample, size_t sampleSize)
+	{
+		std::vector<std::pair<size_t, Tuning>> savedProfile;
+		savedProfile.swap(tuning);
+		Tuning saved = getTuning();
+		std::vector<size_t> sizes;
+		for (size_t n = 16; n <= sampleSize; n *= 4) sizes.push_back(n);
+
+		std::vector<Tuning> best(sizes.size());
+		size_t smallThreshold = 0, smallTimed = 0;
+		for (size_t c = 0; c < sizes.size(); c++)
+		{
+			size_t n = sizes[c];
+			Tuning t = saved;
+			t.parallelThreshold = std::numeric_limits<size_t>::max();
+			t.threads = 0;
+			// Small sizes: insertion sort or radix passes. The threshold ends up at the first size where the passes win.
+			if (n <= 256 && smallThreshold == 0)
+			{
+				Tuning ins = t, rad = t;
+				ins.smallSortThreshold = n + 1;
+				rad.smallSortThreshold = 0;
+				if (timeTrial(sample, n, rad) < timeTrial(sample, n, ins)) smallThreshold = n;
+				smallTimed = n;
+			}
+			t.smallSortThreshold = 0;
+			double bestTime = timeTrial(sample, n, t);
+			auto tryCandidate = [&](const Tuning& cand)
+			{
+				// Has to win by a little, so noise doesn't flip settings back and forth
+				double time = timeTrial(sample, n, cand);
+				if (time < bestTime * 0.98) { bestTime = time; t = cand; }
+			};
+			Tuning cand = t;
+			cand.keepMemory = !t.keepMemory;
+			tryCandidate(cand);
+			if (sizeof(T) >= 16 && n >= 0x100)
+			{
+				// Tags or not. Only the on/off matters, there's just the one sizeof(T).
+				cand = t;
+				cand.indirectBytes = (t.indirectBytes && sizeof(T) >= t.indirectBytes) ? 0 : sizeof(T);
+				tryCandidate(cand);
+			}
+			if (n >= 0x1000)
+			{
+				const size_t prefetch[] = { 0, 0x2000, 0x8000, 0x20000 };
+				Tuning base = t;
+				for (size_t bytes : prefetch)
+				{
+					cand = base;
+					cand.prefetchBytes = bytes;
+					if (bytes != base.prefetchBytes) tryCandidate(cand);
+				}
+#ifndef RADIX_SORT_NO_THREADS
+				if (pool && pool->size() > 1)
+				{
+					base = t;
+					for (unsigned threads = 2; ; threads *= 2)
+					{
+						cand = base;
+						cand.parallelThreshold = c ? n / 2 : 0; // = this entry's minSize
+						cand.threads = std::min(threads, pool->size());
+						tryCandidate(cand);
+						if (threads >= pool->size()) break;
+					}
+				}
+#endif
+			}
+			best[c] = t;
+		}
+		// Insertion sort won every size we timed: keep it up to the biggest one, since we don't know what happens above
+		if (smallThreshold == 0) smallThreshold = smallTimed ? smallTimed + 1 : saved.smallSortThreshold;
+		std::string type = profileKey();
+		for (size_t c = 0; c < sizes.size(); c++)
+		{
+			best[c].smallSortThreshold = smallThreshold;
+			profile.set(type, c ? sizes[c] / 2 : 0, best[c]);
+		}
+		setTuning(saved);
+		tuning.swap(savedProfile);
+	}
+
+private:
+	// Picks the profile's settings for an array of numElements, if there is a profile
+	void tuneFor(size_t numElements)
+	{
+		if (tuning.empty()) return;
+		size_t i = tuning.size() - 1;
+		while (i > 0 && tuning[i].first > numElements) i--;
+		applyTuning(tuning[i].second, pinned);
+	}
+
+	// Takes t's settings, except the ones in the Pin* bits of keep
+	void applyTuning(const Tuning& t, unsigned keep)
+	{
+		if (!(keep & PinSmallSort)) smallSortThreshold = t.smallSortThreshold;
+		prefetchInterval = t.prefetchBytes ? std::max<size_t>(1, t.prefetchBytes / sizeof(T)) : 0;
+		keepMemory = t.keepMemory;
+		indirectBytes = t.indirectBytes;
+#ifndef RADIX_SORT_NO_THREADS
+		if (!(keep & PinParallel)) parallelThreshold = t.parallelThreshold;
+		if (!(keep & PinThreads)) maxTasks = t.threads;
+#endif
+	}
+
+	// Seconds per sort() of n elements like sample with settings t. Best of 3, and small arrays are
+	// sorted many at a time so the clock has something to measure.
+	double timeTrial(const T* sample, size_t n, const Tuning& t)
+	{
+		setTuning(t);
+		size_t batch = std::max<size_t>(1, 0x10000 / n);
+		std::vector<T> work;
+		work.reserve(n * batch);
+		for (size_t b = 0; b < batch; b++) work.insert(work.end(), sample, sample + n);
+		double best = 0;
+		for (int rep = 0; rep < 3; rep++)
+		{
+			if (rep) { for (size_t b = 0; b < batch; b++) std::copy(sample, sample + n, work.begin() + b * n); }
+			auto beg = std::chrono::steady_clock::now();
+			for (size_t b = 0; b < batch; b++) sort(work.data() + b * n, n);
+			double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - beg).count() / batch;
+			if (rep == 0 || time < best) best = time;
+		}
+		free();
+		return best;
+	}
+
+public:
+
+#ifndef RADIX_SORT_NO_THREADS
+	// Called when an async request finishes, with nullptr on success or the exception
+	// it failed with (SortCancelled if it was cancelled).
+	typedef std::function<void(std::exception_ptr)> Completion;
+
+	// Sorts on exec, which is anything callable with a std::function<void()> (WorkQueue,
+	// NewThreadExecutor, your own). The request gets a Sorter of its own, set up like this one,
+	// so it has its own scratch memory and several can run at once. It shares this Sorter's
+	// thread pool, so if that pool is owned by this Sorter (useThreads()), keep this Sorter alive
+	// until the request is done. data must stay valid until then too.
+	template <class Executor>
+	std::future<void> sortAsync(Executor&& exec, T* data, size_t numElements, CancelToken cancel = CancelToken(), Completion onDone = nullptr)
+	{
+		auto job = makeJob(cancel);
+		return post(exec, [job, data, numElements] { job->sort(data, numElements); }, onDone);
+	}
+	std::future<void> sortAsync(T* data, size_t numElements, CancelToken cancel = CancelToken(), Completion onDone = nullptr)
+	{
+		return sortAsync(NewThreadExecutor(), data, numElements, cancel, onDone);
+	}
+
+	template <class Executor>
+	std::future<void> viewAsync(Executor&& exec, const T* a, size_t* IndecesOut, size_t numElements, CancelToken cancel = CancelToken(), Completion onDone = nullptr)
+	{
+		auto job = makeJob(cancel);
+		return post(exec, [job, a, IndecesOut, numElements] { job->view(a, IndecesOut, numElements); }, onDone);
+	}
+	std::future<void> viewAsync(const T* a, size_t* IndecesOut, size_t numElements, CancelToken cancel = CancelToken(), Completion onDone = nullptr)
+	{
+		return viewAsync(NewThreadExecutor(), a, IndecesOut, numElements, cancel, onDone);
+	}
+
+private:
+	// A fresh Sorter with the same settings but no buffers
+	std::shared_ptr<Sorter> makeJob(const CancelToken& cancel) const
+	{
+		auto job = std::make_shared<Sorter>();
+		job->getByte = getByte;
+		job->getSize = getSize;
+		job->negativeOverride = negativeOverride;
+		job->floatOverride = floatOverride;
+		job->pool = pool;
+		job->setTuning(getTuning());
+		job->tuning = tuning;
+		job->pinned = pinned;
+		job->setCancelToken(cancel);
+		return job;
+	}
+
+	template <class Executor>
+	static std::future<void> post(Executor& exec, std::function<void()> work, Completion onDone)
+	{
+		auto done = std::make_shared<std::promise<void>>();
+		std::future<void> result = done->get_future();
+		exec(std::function<void()>([done, work, onDone]
+		{
+			std::exception_ptr err;
+			try { work(); }
+			catch (...) { err = std::current_exception(); }
+			if (onDone)
+			{
+				try { onDone(err); }
+				catch (...) { if (!err) err = std::current_exception(); }
+			}
+			if (err) done->set_exception(err);
+			else done->set_value();
+		}));
+		return result;
+	}
+public:
+#endif
 
 
 }; // class Sorter
@@ -1,4 +1,6 @@
 #include <iostream>
+#include <chrono>
+#include <vector>
 #include "RadixSort.h"
 #include "test.h"
 
@@ -18,6 +20,48 @@ void defaultTest()
 	testStr(10000, 10, 1234, 8, false);
 	std::cout << "\n\n [[[ FLOAT TEST ]]]\n\n";
 	testFloat(100000, 100, 1234, -999.9f, 999.9f, false);
+	std::cout << "\n\n [[[ MOVE-ONLY TEST ]]]\n\n";
+	testMoveOnly(100000, 10, 1234, -999, 999);
+	std::cout << "\n\n [[[ PARALLEL TEST ]]]\n\n";
+	testParallel(1000000, 10, 1234, 0);
+	std::cout << "\n\n [[[ ASYNC TEST ]]]\n\n";
+	testAsync(100000, 8, 1234);
+	std::cout << "\n\n [[[ SEGMENTED TEST ]]]\n\n";
+	testSegments(100000, 1234, 1);
+	testSegments(100000, 1234, 0);
+	std::cout << "\n\n [[[ RUNS / UNIQUE TEST ]]]\n\n";
+	testRuns(100000, 1234, 1);
+	testRuns(100000, 1234, 0);
+	std::cout << "\n\n [[[ COLUMNS TEST ]]]\n\n";
+	testColumns(1000000, 1234, 1);
+	testColumns(1000000, 1234, 0);
+	std::cout << "\n\n [[[ VIEW TEST ]]]\n\n";
+	testView(100000, 1234);
+	std::cout << "\n\n [[[ PROFILE TEST ]]]\n\n";
+	testProfile(100000, 1234, 1);
+	testProfile(100000, 1234, 0);
+	std::cout << "\n\n [[[ RANK TEST ]]]\n\n";
+	testRank(100000, 1234);
+	std::cout << "\n\n [[[ INDIRECT TEST ]]]\n\n";
+	testIndirect(100000, 1234);
+	std::cout << "\n\n [[[ PARTITION TEST ]]]\n\n";
+	testPartition(100000, 1234, 1);
+	testPartition(100000, 1234, 0);
+	std::cout << "\n\n [[[ HANDOFF TEST ]]]\n\n";
+	testHandoff(100000, 1234, 1);
+	testHandoff(100000, 1234, 0);
+	std::cout << "\n\n [[[ NARROW KEY TEST ]]]\n\n";
+	testNarrow(100000, 1234);
+#ifdef __linux__
+	std::cout << "\n\n [[[ DISTRIBUTED TEST ]]]\n\n";
+	testDistributed(20000, 4, 1234);
+	std::cout << "\n\n [[[ SORTFILE TEST ]]]\n\n";
+	testSortFile("./sortfile", 5000, 1234);
+#endif
+#ifdef RADIX_SORT_PERF_COUNTERS
+	std::cout << "\n\n [[[ PERF COUNTER TEST ]]]\n\n";
+	testPerfCounters(100000, 1234);
+#endif
 }
 
 void compareStdSort(size_t size, int seed, float minVal, float maxVal)
@@ -86,6 +130,93 @@ std::sort(dataStd, dataStd + size);
 
 }
 
+// Stand-in for decoding/reading a batch: generate it a value at a time.
+void loadBatch(std::vector<float>& batch, unsigned seed, float minVal, float maxVal)
+{
+	srand(seed);
+	for (auto& x : batch) x = minVal + ((maxVal - minVal) * (float)rand() / (float)RAND_MAX);
+}
+
+// Load batch N+1 while batch N is sorted on a WorkQueue, vs. load-then-sort on one thread.
+void pipelineBenchmark(size_t batchSize, int numBatches)
+{
+	typedef std::chrono::steady_clock clk;
+	std::vector<float> batches[2] = { std::vector<float>(batchSize), std::vector<float>(batchSize) };
+	FloatSorter rad;
+
+	cout << "Serial: load, sort, load, sort...\n";
+	auto begSerial = clk::now();
+	for (int n = 0; n < numBatches; n++)
+	{
+		loadBatch(batches[0], n, -999.0f, 999.0f);
+		rad.sort(batches[0].data(), batchSize); // frees its scratch, like each async job does
+	}
+	auto endSerial = clk::now();
+
+	cout << "Pipelined: sort batch N on a WorkQueue while loading N+1\n";
+	WorkQueue sortQueue(1);
+	std::future<void> inFlight;
+	auto begPipe = clk::now();
+	for (int n = 0; n < numBatches; n++)
+	{
+		std::vector<float>& batch = batches[n & 1];
+		loadBatch(batch, n, -999.0f, 999.0f);
+		if (inFlight.valid()) inFlight.get();
+		inFlight = rad.sortAsync(sortQueue, batch.data(), batchSize);
+	}
+	if (inFlight.valid()) inFlight.get();
+	auto endPipe = clk::now();
+
+	double serialTime = std::chrono::duration<double>(endSerial - begSerial).count();
+	double pipeTime = std::chrono::duration<double>(endPipe - begPipe).count();
+	cout << "Results: " << numBatches << " batches of " << batchSize << "\n"
+		 << "     Serial: " << serialTime << " seconds = " << (numBatches * batchSize / serialTime) << " el/s\n"
+		 << "  Pipelined: " << pipeTime << " seconds = " << (numBatches * batchSize / pipeTime) << " el/s\n";
+}
+
+// Measures the best settings for floats on this machine and saves them.
+// Run with RADIX_SORT_PROFILE=radix_profile.txt to have every Sorter use them.
+void calibrateProfile(size_t sampleSize, const char* path)
+{
+	std::vector<float> sample(sampleSize);
+	loadBatch(sample, 1234, -999.0f, 999.0f);
+	FloatSorter rad;
+	Profile profile;
+	if (!profile.load(path)) cout << "Starting a new profile\n";
+	cout << "Calibrating...\n";
+	rad.calibrate(profile, sample.data(), sampleSize);
+	if (profile.save(path)) cout << "Saved " << path << "\n";
+	else cout << "Can't write " << path << "\n";
+}
+
+// Cycles, instructions and cache/TLB misses for each phase and pass, summed over numRuns sorts
+void perfCounterReport(size_t size, int numRuns)
+{
+#ifdef RADIX_SORT_PERF_COUNTERS
+	std::vector<float> batch(size);
+	std::vector<size_t> order(size);
+	FloatSorter rad;
+	PerfRecorder sortPerf, viewPerf;
+	for (int n = 0; n < numRuns; n++)
+	{
+		loadBatch(batch, n, -999.0f, 999.0f);
+		rad.setPerfRecorder(&viewPerf);
+		rad.view(batch.data(), order.data(), size, true);
+		rad.setPerfRecorder(&sortPerf);
+		rad.sort(batch.data(), size, true);
+	}
+	rad.setPerfRecorder(nullptr);
+	cout << "sort(), " << numRuns << " x " << size << " floats:\n";
+	sortPerf.print(cout);
+	cout << "\nview(), " << numRuns << " x " << size << " floats:\n";
+	viewPerf.print(cout);
+#else
+	(void)size;
+	(void)numRuns;
+	cout << "Build with RADIX_SORT_PERF_COUNTERS defined (Linux only) for this.\n";
+#endif
+}
+
 int main()
 {
 	//testStr(10, 1, 11, 4, true);
@@ -97,7 +228,7 @@ int main()
 	float maxVal = 0;
 	do
 	{
-		cout << "Menu:\n 0. Exit\n 1. Default test.\n 2. Compare to std::sort\n 3. Manual test (float)\n 4. Repeat last manual test\n 5. Unsigned int test\n ...\n 9. Current dev test\n> ";
+		cout << "Menu:\n 0. Exit\n 1. Default test.\n 2. Compare to std::sort\n 3. Manual test (float)\n 4. Repeat last manual test\n 5. Unsigned int test\n 6. Async pipeline benchmark\n 7. Calibrate float profile\n 8. Hardware counters per pass\n ...\n 9. Current dev test\n> ";
 
 		cin >> option;
 		switch (option)
@@ -124,6 +255,15 @@ int main()
 			case 5:
 				testInt(10, 1, 11, 1, 10, true);
 				break;
+			case 6:
+				pipelineBenchmark(1000000, 20);
+				break;
+			case 7:
+				calibrateProfile(4000000, "radix_profile.txt");
+				break;
+			case 8:
+				perfCounterReport(10000000, 10);
+				break;
 			case 9:
 				compareStdSort(10000000, 11, -999, 999);
 				break;
@@ -0,0 +1,275 @@
+// sortfile - sort a file of fixed-size binary records by a key at a byte offset, using RadixSort::Sorter.
+// Linux only. The input is memory mapped, so multi-GB files are never read into the heap; only the
+// (key, record number) pairs are. Build it next to the interactive test program:
+//
+//     g++ -std=c++14 -O2 -pthread sortfile.cpp -o sortfile
+//
+// Usage:
+//     sortfile --record N --offset K --key TYPE [--desc] [--threads N] (-o OUTPUT | --in-place) INPUT
+//
+//     TYPE is u32, i64, f32, f64 (host byte order) or bytesN (N raw bytes compared like memcmp).
+//     --threads 0 uses one thread per core, 1 (the default) stays on the main thread.
+//     --desc sorts largest first. Both directions are stable.
+
+#ifndef __linux__
+#error "sortfile is Linux only (mmap/madvise)"
+#endif
+
+#include "RadixSort.h"
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace RadixSort;
+
+struct Options
+{
+	size_t record = 0;
+	size_t offset = 0;
+	std::string key;
+	size_t keyBytes = 0;
+	bool desc = false;
+	int threads = 1;
+	bool inPlace = false;
+	const char* output = nullptr;
+	const char* input = nullptr;
+};
+
+struct Timings
+{
+	double map = 0, extract = 0, sort = 0, write = 0;
+};
+
+typedef Sorter<std::pair<uint32_t, size_t>, IndexIntPair<uint32_t>, GetSizeIntPair<uint32_t>> U32Sorter;
+typedef Sorter<std::pair<uint64_t, size_t>, IndexIntPair<uint64_t>, GetSizeIntPair<uint64_t>> U64Sorter;
+typedef Sorter<std::pair<long long, size_t>, IndexIntPair<long long>, GetSizeIntPair<long long>> I64Sorter;
+
+typedef std::chrono::steady_clock clk;
+static double secondsSince(clk::time_point t) { return std::chrono::duration<double>(clk::now() - t).count(); }
+
+static void usage()
+{
+	std::cerr << "usage: sortfile --record N --offset K --key u32|i64|f32|f64|bytesN [--desc] [--threads N]\n"
+	             "                (-o OUTPUT | --in-place) INPUT\n";
+	exit(2);
+}
+
+static void fail(const std::string& what)
+{
+	std::cerr << "sortfile: " << what;
+	if (errno) std::cerr << ": " << strerror(errno);
+	std::cerr << "\n";
+	exit(1);
+}
+
+static bool parseArgs(int argc, char** argv, Options& opt)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string a = argv[i];
+		bool hasNext = i + 1 < argc;
+		if (a == "--record" && hasNext) opt.record = strtoull(argv[++i], nullptr, 10);
+		else if (a == "--offset" && hasNext) opt.offset = strtoull(argv[++i], nullptr, 10);
+		else if (a == "--key" && hasNext) opt.key = argv[++i];
+		else if (a == "--threads" && hasNext) opt.threads = atoi(argv[++i]);
+		else if (a == "--desc") opt.desc = true;
+		else if (a == "--in-place") opt.inPlace = true;
+		else if (a == "-o" && hasNext) opt.output = argv[++i];
+		else if (a[0] != '-' && !opt.input) opt.input = argv[i];
+		else return false;
+	}
+	if (opt.key == "u32" || opt.key == "f32") opt.keyBytes = 4;
+	else if (opt.key == "i64" || opt.key == "f64") opt.keyBytes = 8;
+	else if (opt.key.compare(0, 5, "bytes") == 0) opt.keyBytes = strtoull(opt.key.c_str() + 5, nullptr, 10);
+	if (!opt.input || !opt.record || !opt.keyBytes) return false;
+	if (opt.inPlace == (opt.output != nullptr)) return false;
+	if (opt.offset + opt.keyBytes > opt.record) return false;
+	return true;
+}
+
+// Descending order is done by flipping the keys, so equal keys keep their input order.
+template <typename K> static K flipKey(K k) { return ~k; }
+static std::string flipKey(std::string k) { for (auto& c : k) c = ~c; return k; }
+
+template <typename K> static void readKey(const unsigned char* p, size_t /*n*/, K& k) { memcpy(&k, p, sizeof(K)); }
+static void readKey(const unsigned char* p, size_t n, std::string& k) { k.assign((const char*)p, n); }
+
+struct ReadNative
+{
+	template <typename K> static K read(const unsigned char* p, size_t n) { K k; readKey(p, n, k); return k; }
+};
+
+// bytesN up to 8: big endian packing so integer order is byte order. All keys are n bytes, no need to left-align.
+struct ReadPacked
+{
+	template <typename K> static K read(const unsigned char* p, size_t n)
+	{
+		K k = 0;
+		for (size_t i = 0; i < n; i++) k = (k << 8) | p[i];
+		return k;
+	}
+};
+
+// Floats are sorted as unsigned integers with the same order: set the sign bit of positives, flip every bit of negatives.
+// Sorting them as floats would be just as fast, but the negative half comes out reversed, so equal keys lose their input order.
+template <typename F>
+struct ReadFloatBits
+{
+	template <typename K> static K read(const unsigned char* p, size_t /*n*/)
+	{
+		static_assert(sizeof(K) == sizeof(F), "Float key needs an unsigned integer of the same width");
+		K k;
+		memcpy(&k, p, sizeof(K));
+		const K sign = K(1) << (sizeof(K) * 8 - 1);
+		return (k & sign) ? ~k : (k | sign);
+	}
+};
+
+// Record i goes to position i of the output, from record perm[i].second of the input.
+template <typename P>
+static void gatherRecords(unsigned char* dest, const unsigned char* src, const std::vector<P>& perm, size_t record)
+{
+	const size_t ahead = 16;
+	size_t n = perm.size();
+	for (size_t i = 0; i < n; i++)
+	{
+		if (i + ahead < n) RADIX_SORT_PREFETCH(src + perm[i + ahead].second * record);
+		memcpy(dest + i * record, src + perm[i].second * record, record);
+	}
+}
+
+// Follow each cycle of the permutation, so every record is moved once and only one record of extra memory is used.
+// perm[j].second is set to j once position j holds its final record.
+template <typename P>
+static void permuteInPlace(unsigned char* data, std::vector<P>& perm, size_t record)
+{
+	std::vector<unsigned char> hold(record);
+	size_t n = perm.size();
+	for (size_t i = 0; i < n; i++)
+	{
+		if (perm[i].second == i) continue;
+		memcpy(hold.data(), data + i * record, record);
+		size_t j = i;
+		for (;;)
+		{
+			size_t from = perm[j].second;
+			perm[j].second = j;
+			if (from == i)
+			{
+				memcpy(data + j * record, hold.data(), record);
+				break;
+			}
+			memcpy(data + j * record, data + from * record, record);
+			j = from;
+		}
+	}
+}
+
+template <typename K, class Read, class SorterT>
+static void sortFile(SorterT& rad, const Options& opt, unsigned char* in, size_t fileSize, Timings& t)
+{
+	size_t n = fileSize / opt.record;
+	auto beg = clk::now();
+	std::vector<std::pair<K, size_t>> keys(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		K k = Read::template read<K>(in + i * opt.record + opt.offset, opt.keyBytes);
+		keys[i].first = opt.desc ? flipKey(k) : k;
+		keys[i].second = i;
+	}
+	t.extract = secondsSince(beg);
+
+	if (opt.threads != 1) rad.useThreads(opt.threads > 0 ? opt.threads : 0);
+	beg = clk::now();
+	rad.sort(keys.data(), n);
+	t.sort = secondsSince(beg);
+
+	beg = clk::now();
+	if (opt.inPlace)
+	{
+		madvise(in, fileSize, MADV_RANDOM);
+		permuteInPlace(in, keys, opt.record);
+	}
+	else
+	{
+		int fd = open(opt.output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) fail(std::string("can't open ") + opt.output);
+		if (ftruncate(fd, fileSize) != 0) fail("can't size output");
+		if (fileSize)
+		{
+			void* out = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (out == MAP_FAILED) fail("can't map output");
+			madvise(out, fileSize, MADV_SEQUENTIAL);
+			madvise(in, fileSize, MADV_RANDOM);
+			gatherRecords((unsigned char*)out, in, keys, opt.record);
+			munmap(out, fileSize);
+		}
+		close(fd);
+	}
+	t.write = secondsSince(beg);
+}
+
+int main(int argc, char** argv)
+{
+	Options opt;
+	if (!parseArgs(argc, argv, opt)) usage();
+
+	auto beg = clk::now();
+	int fd = open(opt.input, opt.inPlace ? O_RDWR : O_RDONLY);
+	if (fd < 0) fail(std::string("can't open ") + opt.input);
+	struct stat st;
+	if (fstat(fd, &st) != 0) fail("can't stat input");
+	size_t fileSize = (size_t)st.st_size;
+	if (fileSize % opt.record) { errno = 0; fail("file size is not a multiple of the record size"); }
+	// Opening the output truncates it, and the input is about to be mapped
+	struct stat outSt;
+	if (!opt.inPlace && stat(opt.output, &outSt) == 0 && outSt.st_dev == st.st_dev && outSt.st_ino == st.st_ino)
+	{
+		errno = 0;
+		fail("the output is the input; use --in-place to sort a file in place");
+	}
+	errno = 0;
+	unsigned char* in = nullptr;
+	if (fileSize)
+	{
+		void* p = mmap(nullptr, fileSize, opt.inPlace ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) fail("can't map input");
+		in = (unsigned char*)p;
+		madvise(in, fileSize, MADV_SEQUENTIAL);
+	}
+	Timings t;
+	t.map = secondsSince(beg);
+
+	if (opt.key == "u32") { U32Sorter rad; sortFile<uint32_t, ReadNative>(rad, opt, in, fileSize, t); }
+	else if (opt.key == "i64") { I64Sorter rad(-1); sortFile<long long, ReadNative>(rad, opt, in, fileSize, t); }
+	else if (opt.key == "f32") { U32Sorter rad; sortFile<uint32_t, ReadFloatBits<float>>(rad, opt, in, fileSize, t); }
+	else if (opt.key == "f64") { U64Sorter rad; sortFile<uint64_t, ReadFloatBits<double>>(rad, opt, in, fileSize, t); }
+	else if (opt.keyBytes <= 4) { U32Sorter rad; sortFile<uint32_t, ReadPacked>(rad, opt, in, fileSize, t); }
+	else if (opt.keyBytes <= 8) { U64Sorter rad; sortFile<uint64_t, ReadPacked>(rad, opt, in, fileSize, t); }
+	else { StringPairSorter rad; sortFile<std::string, ReadNative>(rad, opt, in, fileSize, t); }
+
+	beg = clk::now();
+	if (in) munmap(in, fileSize);
+	close(fd);
+	t.write += secondsSince(beg);
+
+	size_t n = fileSize / opt.record;
+	double total = t.map + t.extract + t.sort + t.write;
+	double mb = fileSize / 1048576.0;
+	std::cout << n << " records, " << mb << " MB\n"
+	          << "  map:     " << t.map << " s\n"
+	          << "  extract: " << t.extract << " s\n"
+	          << "  sort:    " << t.sort << " s (" << (t.sort > 0 ? n / t.sort : 0) << " keys/s)\n"
+	          << "  write:   " << t.write << " s\n"
+	          << "  total:   " << total << " s (" << (total > 0 ? mb / total : 0) << " MB/s)\n";
+	return 0;
+}
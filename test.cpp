@@ -3,9 +3,17 @@
 
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <vector>
+#include <cstdio>
+#include <sstream>
+#include <iomanip>
 #ifdef _WIN32
 #include <Windows.h>
 #endif
+#ifdef __linux__
+#include "DistributedSort.h"
+#endif
 
 using namespace RadixSort;
 
@@ -319,3 +327,1023 @@ bool testFloat(size_t testSize, int numTests, int testSeed, float minValue, floa
 } // main()
 
 
+
+// Move-only and not default constructible. sort() must never copy or default-construct one of these.
+struct MoveOnlyKey
+{
+	std::unique_ptr<int> p;
+	explicit MoveOnlyKey(int v) : p(new int(v)) {}
+	MoveOnlyKey(MoveOnlyKey&&) = default;
+	MoveOnlyKey& operator=(MoveOnlyKey&&) = default;
+};
+struct IndexMoveOnlyKey
+{
+	IndexInt<int> ind;
+	inline unsigned char operator()(const MoveOnlyKey& k, int byte) { return ind(*k.p, byte); }
+};
+struct GetSizeMoveOnlyKey { inline int operator()(const MoveOnlyKey& /*k*/) { return sizeof(int); } };
+
+bool testMoveOnly(size_t testSize, int numTests, int testSeed, int minValue, int maxValue)
+{
+	srand(testSeed);
+	int nGood = 0;
+
+	std::cout << "size = " << testSize << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+
+	Sorter<MoveOnlyKey, IndexMoveOnlyKey, GetSizeMoveOnlyKey> rad(-1);
+	for (int iTest = 0; iTest < numTests; iTest++)
+	{
+		std::vector<MoveOnlyKey> testData;
+		testData.reserve(testSize);
+		for (size_t i = 0; i < testSize; i++)
+		{
+			testData.emplace_back(minValue + (rand() % (maxValue - minValue)));
+		}
+
+		// Keep the scratch buffer between iterations, so its raw storage gets reused.
+		rad.sort(testData.data(), testSize, true);
+
+		bool good = true;
+		for (size_t i = 0; i + 1 < testSize; i++)
+		{
+			if (!testData[i].p || !testData[i + 1].p || *testData[i + 1].p < *testData[i].p)
+			{
+				good = false;
+				break;
+			}
+		}
+		if (good) { nGood++; }
+		else { std::cout << "    Iteration " << iTest << " failed!\n"; }
+	}
+	rad.free();
+
+	std::cout << "\n=== SUMMARY ===\n";
+	if (nGood == numTests) { std::cout << "All good! (" << numTests << " iterations.)\n"; }
+	else { std::cout << nGood << " / " << numTests << " passed.\n"; }
+	return nGood == numTests;
+}
+
+// Sorts the same data with a pooled Sorter and with std::sort() and compares.
+// One pool shared by an int and a string Sorter, reused for every iteration.
+bool testParallel(size_t testSize, int numTests, int testSeed, unsigned numThreads)
+{
+	srand(testSeed);
+	int nGood = 0;
+
+	std::cout << "size = " << testSize << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+
+	ThreadPool pool(numThreads);
+	std::cout << "threads = " << pool.size() << std::endl;
+	Sorter<int> radInt;
+	StringSorter radStr;
+	radInt.setThreadPool(&pool);
+	radStr.setThreadPool(&pool);
+	radInt.setParallelThreshold(1000);
+	radStr.setParallelThreshold(1000);
+
+	std::vector<int> ints(testSize), intsStd;
+	std::vector<std::string> strs(testSize), strsStd;
+	for (int iTest = 0; iTest < numTests; iTest++)
+	{
+		for (size_t i = 0; i < testSize; i++)
+		{
+			ints[i] = rand() - (RAND_MAX / 2);
+			strs[i].clear();
+			int len = rand() % 8;
+			for (int si = 0; si < len; si++) strs[i] += (char)('a' + rand() % 26);
+		}
+		intsStd = ints;
+		strsStd = strs;
+		radInt.sort(ints.data(), testSize, true);
+		radStr.sort(strs.data(), testSize, true);
+		std::sort(intsStd.begin(), intsStd.end());
+		std::sort(strsStd.begin(), strsStd.end());
+
+		if (ints == intsStd && strs == strsStd) { nGood++; }
+		else { std::cout << "    Iteration " << iTest << " failed!\n"; }
+	}
+
+	std::cout << "\n=== SUMMARY ===\n";
+	if (nGood == numTests) { std::cout << "All good! (" << numTests << " iterations.)\n"; }
+	else { std::cout << nGood << " / " << numTests << " passed.\n"; }
+	return nGood == numTests;
+}
+
+// Several sortAsync()/viewAsync() requests in flight on one Sorter, plus one that gets cancelled.
+bool testAsync(size_t testSize, int numRequests, int testSeed)
+{
+	srand(testSeed);
+	bool good = true;
+
+	std::cout << "size = " << testSize << std::endl;
+	std::cout << "requests = " << numRequests << std::endl;
+
+	WorkQueue queue(2);
+	Sorter<int> rad;
+	std::vector<std::vector<int>> batches(numRequests);
+	std::vector<std::future<void>> pending;
+	std::atomic<int> callbacks(0);
+	for (int r = 0; r < numRequests; r++)
+	{
+		batches[r].resize(testSize);
+		for (size_t i = 0; i < testSize; i++) batches[r][i] = rand() - (RAND_MAX / 2);
+		pending.push_back(rad.sortAsync(queue, batches[r].data(), testSize, CancelToken(),
+			[&callbacks](std::exception_ptr err) { if (!err) callbacks++; }));
+	}
+
+	std::vector<float> floats(testSize);
+	std::vector<size_t> order(testSize);
+	for (size_t i = 0; i < testSize; i++) floats[i] = -999.9f + ((float)rand() / (float)RAND_MAX) * 1999.8f;
+	FloatSorter radFloat;
+	std::future<void> viewDone = radFloat.viewAsync(queue, floats.data(), order.data(), testSize);
+
+	for (auto& f : pending) f.get();
+	for (int r = 0; r < numRequests; r++)
+	{
+		if (!std::is_sorted(batches[r].begin(), batches[r].end())) { std::cout << "    Request " << r << " not sorted!\n"; good = false; }
+	}
+	if (callbacks != numRequests) { std::cout << "    Only " << callbacks << " completion callbacks ran!\n"; good = false; }
+
+	viewDone.get();
+	for (size_t i = 0; i + 1 < testSize; i++)
+	{
+		if (floats[order[i + 1]] < floats[order[i]]) { std::cout << "    viewAsync() order is wrong!\n"; good = false; break; }
+	}
+
+	// Cancelled before it starts: must throw, and leave the caller's data intact (same values, any order)
+	std::vector<int> data = batches[0], before;
+	std::reverse(data.begin(), data.end());
+	before = data;
+	CancelToken cancel;
+	cancel.cancel();
+	bool threw = false;
+	try { rad.sortAsync(queue, data.data(), testSize, cancel).get(); }
+	catch (SortCancelled&) { threw = true; }
+	std::sort(data.begin(), data.end());
+	std::sort(before.begin(), before.end());
+	if (!threw || data != before) { std::cout << "    Cancelled request misbehaved!\n"; good = false; }
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
+
+// Lots of small segments plus a few big ones, checked against std::sort() per segment.
+bool testSegments(size_t numSegments, int testSeed, unsigned numThreads)
+{
+	srand(testSeed);
+	std::vector<size_t> offsets(1, 0);
+	for (size_t s = 0; s < numSegments; s++)
+	{
+		size_t len = (s % 1000 == 999) ? 20000 + rand() % 20000 : rand() % 200;
+		offsets.push_back(offsets.back() + len);
+	}
+	std::vector<float> data(offsets.back()), expected;
+	for (auto& x : data) x = -999.9f + ((float)rand() / (float)RAND_MAX) * 1999.8f;
+	expected = data;
+	for (size_t s = 0; s < numSegments; s++) std::sort(expected.begin() + offsets[s], expected.begin() + offsets[s + 1]);
+
+	std::cout << "segments = " << numSegments << std::endl;
+	std::cout << "elements = " << data.size() << std::endl;
+
+	FloatSorter rad;
+	if (numThreads != 1) { rad.useThreads(numThreads); rad.setParallelThreshold(10000); }
+	rad.sortSegments(data.data(), offsets.data(), numSegments);
+	bool good = (data == expected);
+
+	// Narrow int keys, so the segments take sortNarrow()'s counting sort, each task with its own counts
+	std::vector<int> ints(offsets.back()), expectedInts;
+	for (auto& x : ints) x = (rand() % 200) - 100;
+	expectedInts = ints;
+	for (size_t s = 0; s < numSegments; s++) std::sort(expectedInts.begin() + offsets[s], expectedInts.begin() + offsets[s + 1]);
+	IntSorter radInt;
+	if (numThreads != 1) { radInt.useThreads(numThreads); radInt.setParallelThreshold(10000); }
+	radInt.sortSegments(ints.data(), offsets.data(), numSegments);
+	if (ints != expectedInts) { std::cout << "    int segments failed!\n"; good = false; }
+
+	// Equal keys have to come out in the same order whether a range goes to the insertion sort or to
+	// the radix passes (31 vs 33 elements, around the default threshold of 32), negatives included
+	std::vector<std::pair<float, size_t>> small(31), big(33);
+	for (size_t i = 0; i < 31; i++) small[i] = std::make_pair((float)((rand() % 6) - 3) / 2.0f, i);
+	std::copy(small.begin(), small.end(), big.begin());
+	big[31] = std::make_pair(100.0f, 31);
+	big[32] = std::make_pair(200.0f, 32);
+	std::vector<std::pair<float, size_t>> both(small.begin(), small.end());
+	both.insert(both.end(), big.begin(), big.end());
+	size_t bothOffsets[] = { 0, 31, 64 };
+	FloatPairSorter radPair(-1.0);
+	radPair.sort(small.data(), small.size());
+	radPair.sort(big.data(), big.size());
+	radPair.sortSegments(both.data(), bothOffsets, 2);
+	if (!std::equal(small.begin(), small.end(), big.begin()) || !std::equal(big.begin(), big.end(), both.begin() + 31) ||
+		!std::equal(small.begin(), small.end(), both.begin()))
+	{
+		std::cout << "    tie order depends on the array size!\n";
+		good = false;
+	}
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
+
+template <class S, typename T>
+static bool checkRuns(S& rad, std::vector<T> data, const char* name)
+{
+	std::vector<T> expected = data, sorted = data, uniq = data;
+	std::sort(expected.begin(), expected.end());
+	std::vector<size_t> expStarts, expCounts;
+	for (size_t i = 0; i < expected.size(); i++)
+	{
+		if (i == 0 || expected[i - 1] != expected[i]) { expStarts.push_back(i); expCounts.push_back(0); }
+		expCounts.back()++;
+	}
+
+	std::vector<size_t> starts(data.size()), counts(data.size());
+	size_t nRuns = rad.sortRuns(sorted.data(), sorted.size(), starts.data(), true);
+	size_t nUniq = rad.sortUnique(uniq.data(), uniq.size(), true);
+	size_t nCount = rad.sortCount(data.data(), data.size(), counts.data(), true);
+	starts.resize(nRuns);
+	counts.resize(nCount);
+	uniq.resize(nUniq);
+	data.resize(nCount);
+	expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+
+	bool good = (starts == expStarts && counts == expCounts && uniq == expected && data == expected);
+	if (!good) std::cout << "    " << name << " failed!\n";
+	return good;
+}
+
+// sortRuns()/sortUnique()/sortCount() against std::sort() + a scan, with even and odd pass counts.
+bool testRuns(size_t testSize, int testSeed, unsigned numThreads)
+{
+	srand(testSeed);
+	bool good = true;
+
+	std::cout << "size = " << testSize << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+
+	ThreadPool pool(numThreads ? numThreads : 1);
+	IntSorter radInt;
+	FloatSorter radFloat;
+	StringSorter radStr;
+	Sorter<unsigned char> radByte;
+	if (numThreads != 1)
+	{
+		radInt.setThreadPool(&pool); radInt.setParallelThreshold(1000);
+		radFloat.setThreadPool(&pool); radFloat.setParallelThreshold(1000);
+		radStr.setThreadPool(&pool); radStr.setParallelThreshold(1000);
+		radByte.setThreadPool(&pool); radByte.setParallelThreshold(1000);
+	}
+
+	std::vector<int> ints(testSize);
+	std::vector<float> floats(testSize);
+	std::vector<std::string> strs(testSize);
+	std::vector<unsigned char> bytes(testSize);
+	for (size_t i = 0; i < testSize; i++)
+	{
+		ints[i] = -50 + rand() % 100;
+		floats[i] = (float)(-20 + rand() % 40) * 0.5f;
+		int len = rand() % 4; // up to 3 passes
+		for (int si = 0; si < len; si++) strs[i] += (char)('a' + rand() % 3);
+		bytes[i] = (unsigned char)(rand() % 200);
+	}
+	good &= checkRuns(radInt, ints, "int");
+	good &= checkRuns(radFloat, floats, "float");
+	good &= checkRuns(radStr, strs, "string");
+	good &= checkRuns(radByte, bytes, "unsigned char");
+	ints.resize(20);
+	good &= checkRuns(radInt, ints, "int (small)");
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
+
+// Key column plus payload columns of a few widths; every row must still line up after sortColumns().
+bool testColumns(size_t testSize, int testSeed, unsigned numThreads)
+{
+	srand(testSeed);
+	std::vector<float> keys(testSize);
+	std::vector<int> rowId(testSize);
+	std::vector<double> dbl(testSize);
+	std::vector<unsigned char> byte(testSize);
+	struct Wide { char c[12]; };
+	std::vector<Wide> wide(testSize);
+	for (size_t i = 0; i < testSize; i++)
+	{
+		keys[i] = -999.9f + ((float)rand() / (float)RAND_MAX) * 1999.8f;
+		rowId[i] = (int)i;
+		dbl[i] = keys[i] * 2.0;
+		byte[i] = (unsigned char)(i & 0xFF);
+		memcpy(wide[i].c, &i, std::min(sizeof(i), sizeof(wide[i].c)));
+	}
+	std::vector<float> original = keys;
+
+	std::cout << "size = " << testSize << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+
+	FloatSorter rad;
+	if (numThreads != 1) { rad.useThreads(numThreads); rad.setParallelThreshold(1000); }
+	FloatSorter::Column cols[] = { { rowId.data(), sizeof(int) }, { dbl.data(), sizeof(double) },
+		{ byte.data(), 1 }, { wide.data(), sizeof(Wide) } };
+	rad.sortColumns(keys.data(), testSize, cols, 4);
+
+	bool good = true;
+	for (size_t i = 0; i < testSize && good; i++)
+	{
+		size_t from = (size_t)rowId[i], fromWide = 0;
+		memcpy(&fromWide, wide[i].c, std::min(sizeof(fromWide), sizeof(wide[i].c)));
+		if (i + 1 < testSize && keys[i + 1] < keys[i]) good = false;
+		if (keys[i] != original[from] || dbl[i] != original[from] * 2.0 || byte[i] != (unsigned char)(from & 0xFF) || fromWide != from) good = false;
+	}
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
+
+// view() into size_t, and viewCast() into narrower types, for a few key types.
+bool testView(size_t testSize, int testSeed)
+{
+	srand(testSeed);
+	bool good = true;
+
+	std::cout << "size = " << testSize << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+
+	std::vector<int> ints(testSize);
+	std::vector<float> floats(testSize);
+	std::vector<std::string> strs(testSize);
+	for (size_t i = 0; i < testSize; i++)
+	{
+		ints[i] = rand() - (RAND_MAX / 2);
+		floats[i] = -999.9f + ((float)rand() / (float)RAND_MAX) * 1999.8f;
+		int len = rand() % 6;
+		for (int si = 0; si < len; si++) strs[i] += (char)('a' + rand() % 26);
+	}
+
+	IntSorter radInt;
+	FloatSorter radFloat;
+	StringSorter radStr;
+	std::vector<size_t> order(testSize);
+	std::vector<uint32_t> order32(testSize);
+	std::vector<int> orderInt(testSize);
+
+	// Every index exactly once, and in sorted order
+	auto verify = [&](const char* name, auto& data, auto& ord)
+	{
+		std::vector<bool> seen(testSize, false);
+		for (size_t i = 0; i < testSize; i++)
+		{
+			size_t at = (size_t)ord[i];
+			if (at >= testSize || seen[at] || (i > 0 && data[at] < data[(size_t)ord[i - 1]]))
+			{
+				std::cout << "    " << name << " failed!\n";
+				good = false;
+				return;
+			}
+			seen[at] = true;
+		}
+	};
+	radInt.view(ints.data(), order.data(), testSize, true);           verify("int view()", ints, order);
+	radInt.viewCast(ints.data(), order32.data(), testSize, true);     verify("int viewCast<uint32_t>()", ints, order32);
+	radFloat.view(floats.data(), order.data(), testSize, true);       verify("float view()", floats, order);
+	radFloat.viewCast(floats.data(), orderInt.data(), testSize);      verify("float viewCast<int>()", floats, orderInt);
+	radStr.view(strs.data(), order.data(), testSize);                 verify("string view()", strs, order);
+
+	std::vector<unsigned char> tooNarrow(testSize);
+	bool threw = false;
+	try { radInt.viewCast(ints.data(), tooNarrow.data(), testSize); }
+	catch (std::length_error&) { threw = true; }
+	if (!threw && testSize > 256) { std::cout << "    viewCast<unsigned char>() should have thrown!\n"; good = false; }
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
+
+// calibrate() a profile, round trip it through a file, and sort with it at a few sizes.
+bool testProfile(size_t sampleSize, int testSeed, unsigned numThreads)
+{
+	srand(testSeed);
+	bool good = true;
+	std::vector<float> sample(sampleSize);
+	for (auto& x : sample) x = -999.9f + ((float)rand() / (float)RAND_MAX) * 1999.8f;
+
+	std::cout << "size = " << sampleSize << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+
+	FloatSorter rad;
+	if (numThreads != 1) rad.useThreads(numThreads);
+	Profile calibrated;
+	rad.calibrate(calibrated, sample.data(), sampleSize);
+	std::cout << "    " << calibrated.entriesFor(rad.profileKey()).size() << " entries for " << rad.profileKey() << "\n";
+	if (calibrated.entriesFor("f4").empty()) { std::cout << "    calibrate() added nothing!\n"; good = false; }
+
+	const char* path = "radix_profile_test.txt";
+	Profile loaded;
+	if (!calibrated.save(path) || !loaded.load(path)) { std::cout << "    save()/load() failed!\n"; good = false; }
+	std::remove(path);
+	if (good && loaded.entries.size() != calibrated.entries.size()) { std::cout << "    loaded profile has " << loaded.entries.size() << " entries, expected " << calibrated.entries.size() << "!\n"; good = false; }
+	for (size_t i = 0; i < calibrated.entries.size() && good; i++)
+	{
+		const Tuning& a = calibrated.entries[i].tuning;
+		const Tuning& b = loaded.entries[i].tuning;
+		if (loaded.entries[i].minSize != calibrated.entries[i].minSize ||
+			a.smallSortThreshold != b.smallSortThreshold || a.parallelThreshold != b.parallelThreshold || a.threads != b.threads ||
+			a.prefetchBytes != b.prefetchBytes || a.keepMemory != b.keepMemory || a.indirectBytes != b.indirectBytes)
+		{
+			std::cout << "    loaded profile differs!\n";
+			good = false;
+		}
+	}
+
+	rad.setProfile(loaded);
+	const size_t sizes[] = { 0, 5, 100, 5000, sampleSize };
+	for (size_t n : sizes)
+	{
+		std::vector<float> data(sample.begin(), sample.begin() + std::min(n, sampleSize));
+		rad.sort(data.data(), data.size());
+		if (!std::is_sorted(data.begin(), data.end())) { std::cout << "    sort of " << n << " failed!\n"; good = false; }
+	}
+
+	// Settings set by hand win over the profile
+	rad.setSmallSortThreshold(7);
+	rad.setParallelThreshold(12345);
+	{
+		std::vector<float> data = sample;
+		rad.sort(data.data(), data.size());
+	}
+	if (rad.getSmallSortThreshold() != 7 || rad.getTuning().parallelThreshold != 12345)
+	{
+		std::cout << "    profile overrode setSmallSortThreshold()/setParallelThreshold()!\n";
+		good = false;
+	}
+
+	// fixed() has to behave exactly like a Sorter without a profile
+	FloatSorter plain;
+	plain.setProfile(Profile::fixed());
+	std::vector<float> data = sample;
+	plain.sort(data.data(), data.size());
+	Tuning t = plain.getTuning(), d;
+	if (!std::is_sorted(data.begin(), data.end()) || t.smallSortThreshold != d.smallSortThreshold ||
+		t.parallelThreshold != d.parallelThreshold || t.prefetchBytes != d.prefetchBytes || t.keepMemory != d.keepMemory ||
+		t.indirectBytes != d.indirectBytes)
+	{
+		std::cout << "    fixed() profile isn't the defaults!\n";
+		good = false;
+	}
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
+
+#ifdef RADIX_SORT_PERF_COUNTERS
+// Every pass of sort() and view() should show up in the recorder, and sorting still has to work.
+bool testPerfCounters(size_t testSize, int testSeed)
+{
+	srand(testSeed);
+	bool good = true;
+	std::vector<float> data(testSize);
+	for (auto& x : data) x = -999.9f + ((float)rand() / (float)RAND_MAX) * 1999.8f;
+	std::vector<size_t> order(testSize);
+
+	std::cout << "size = " << testSize << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+
+	PerfRecorder perf;
+	FloatSorter rad;
+	rad.setPerfRecorder(&perf);
+	rad.view(data.data(), order.data(), testSize);
+	rad.sort(data.data(), testSize);
+	perf.print(std::cout);
+
+	if (!std::is_sorted(data.begin(), data.end())) { std::cout << "    sort failed!\n"; good = false; }
+	// print() mustn't leave its formatting on the caller's stream
+	std::ostringstream out;
+	out << std::scientific << std::setprecision(9);
+	std::ios_base::fmtflags flags = out.flags();
+	perf.print(out);
+	if (out.flags() != flags || out.precision() != 9) { std::cout << "    print() changed the stream's format!\n"; good = false; }
+	for (int pass = 0; pass < (int)sizeof(float); pass++)
+	{
+		for (const char* phase : { "histogram", "scatter" })
+		{
+			bool found = false;
+			for (auto& s : perf.samples) found |= (s.pass == pass && std::string(s.phase) == phase);
+			if (!found) { std::cout << "    no " << phase << " sample for pass " << pass << "!\n"; good = false; }
+		}
+	}
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
+#endif
+
+#ifdef __linux__
+// distributedSort() over both transports and both ways of picking splitters, in forked processes.
+// Rank r gets r * perRank ints, so rank 0 starts out empty.
+bool testDistributed(size_t perRank, int numRanks, int testSeed)
+{
+	bool good = true;
+	std::cout << "size = " << perRank << " x rank, " << numRanks << " ranks" << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+
+	char dir[] = "/tmp/radixtestXXXXXX";
+	if (!mkdtemp(dir)) { std::cout << "    mkdtemp() failed!\n"; return false; }
+	size_t total = perRank * numRanks * (numRanks - 1) / 2;
+	for (int useShm = 0; useShm < 2; useShm++)
+	{
+		for (Splitters how : { Splitters::Sample, Splitters::Histogram })
+		{
+			std::string shmName = "/radixtest-" + std::to_string(getpid()) + "-" + std::to_string((int)how);
+			bool ok = forkRanks(numRanks, [&](int rank)
+			{
+				std::unique_ptr<Transport> t;
+				if (useShm) t.reset(new ShmTransport(shmName, rank, numRanks, 4096));
+				else t.reset(new SocketTransport(dir, rank, numRanks));
+				srand(testSeed + rank);
+				std::vector<int> data(perRank * rank);
+				for (auto& x : data) x = (rand() % 20000) - 10000;
+
+				IntSorter rad;
+				distributedSort(*t, rad, data, how);
+				size_t count = 0;
+				for (uint64_t c : allGather(*t, (uint64_t)data.size())) count += (size_t)c;
+				return (checkGlobalOrder(*t, rad, data) && count == total) ? 0 : 1;
+			});
+			std::cout << "    " << (useShm ? "shm" : "socket") << ", " << (how == Splitters::Sample ? "sample" : "histogram") << ": " << (ok ? "ok" : "FAILED") << "\n";
+			good &= ok;
+		}
+	}
+	rmdir(dir);
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
+#endif
+
+#ifdef __linux__
+// Runs the sortfile tool (sortfile.cpp, built separately) on temp files, for every --key type both ways up,
+// with -o and --in-place, and checks the records against std::stable_sort(). Each record carries its input
+// position, so equal keys have to stay in input order too. Skipped if there's no sortfile binary.
+bool testSortFile(const char* sortfilePath, size_t numRecords, int testSeed)
+{
+	std::cout << "size = " << numRecords << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+	if (access(sortfilePath, X_OK) != 0)
+	{
+		std::cout << "    " << sortfilePath << " isn't built, skipped.\n";
+		return true;
+	}
+	srand(testSeed);
+	bool good = true;
+	char dir[] = "/tmp/sortfiletestXXXXXX";
+	if (!mkdtemp(dir)) { std::cout << "    mkdtemp() failed!\n"; return false; }
+	const std::string inPath = std::string(dir) + "/in.bin", outPath = std::string(dir) + "/out.bin";
+
+	// Records of 32 bytes: junk, the key at byte 4, then the input position at byte 24
+	const size_t record = 32, offset = 4;
+	auto writeFile = [](const std::string& path, const std::vector<unsigned char>& bytes)
+	{
+		FILE* f = fopen(path.c_str(), "wb");
+		if (!f) return false;
+		bool ok = bytes.empty() || fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+		return (fclose(f) == 0) && ok;
+	};
+	auto readFile = [](const std::string& path)
+	{
+		std::vector<unsigned char> bytes;
+		FILE* f = fopen(path.c_str(), "rb");
+		if (!f) return bytes;
+		unsigned char buf[4096];
+		size_t got;
+		while ((got = fread(buf, 1, sizeof(buf), f)) > 0) bytes.insert(bytes.end(), buf, buf + got);
+		fclose(f);
+		return bytes;
+	};
+
+	const char* keyTypes[] = { "u32", "i64", "f32", "f64", "bytes3", "bytes8", "bytes12" };
+	for (const char* key : keyTypes)
+	{
+		std::string type = key;
+		size_t keyBytes = (type == "u32" || type == "f32") ? 4 : (type == "i64" || type == "f64") ? 8 : (size_t)atoi(key + 5);
+		// Few distinct keys, so there are plenty of ties. No zeros: f32/f64 order -0 before 0.
+		std::vector<unsigned char> data(numRecords * record);
+		for (size_t i = 0; i < numRecords; i++)
+		{
+			unsigned char* p = &data[i * record];
+			for (size_t b = 0; b < record; b++) p[b] = (unsigned char)rand();
+			int v = (rand() % 200) - 100;
+			if (v == 0) v = 1;
+			if (type == "u32") { uint32_t k = (uint32_t)v * 0x01010101u; memcpy(p + offset, &k, 4); }
+			else if (type == "i64") { long long k = (long long)v * (1ll << 33); memcpy(p + offset, &k, 8); }
+			else if (type == "f32") { float k = v / 4.0f; memcpy(p + offset, &k, 4); }
+			else if (type == "f64") { double k = v / 4.0; memcpy(p + offset, &k, 8); }
+			else { for (size_t b = 0; b < keyBytes; b++) p[offset + b] = (unsigned char)("aAz\x80\xff"[rand() % 5]); }
+			uint64_t pos = i;
+			memcpy(p + 24, &pos, 8);
+		}
+		auto keyLess = [&](size_t a, size_t b)
+		{
+			const unsigned char* pa = &data[a * record + offset];
+			const unsigned char* pb = &data[b * record + offset];
+			if (type == "u32") { uint32_t x, y; memcpy(&x, pa, 4); memcpy(&y, pb, 4); return x < y; }
+			if (type == "i64") { long long x, y; memcpy(&x, pa, 8); memcpy(&y, pb, 8); return x < y; }
+			if (type == "f32") { float x, y; memcpy(&x, pa, 4); memcpy(&y, pb, 4); return x < y; }
+			if (type == "f64") { double x, y; memcpy(&x, pa, 8); memcpy(&y, pb, 8); return x < y; }
+			return memcmp(pa, pb, keyBytes) < 0;
+		};
+
+		for (int desc = 0; desc < 2; desc++)
+		{
+			std::vector<size_t> order(numRecords);
+			for (size_t i = 0; i < numRecords; i++) order[i] = i;
+			if (desc) std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return keyLess(b, a); });
+			else std::stable_sort(order.begin(), order.end(), keyLess);
+			std::vector<unsigned char> expected(data.size());
+			for (size_t i = 0; i < numRecords; i++) memcpy(&expected[i * record], &data[order[i] * record], record);
+
+			for (int inPlace = 0; inPlace < 2; inPlace++)
+			{
+				std::string cmd = std::string(sortfilePath) + " --record " + std::to_string(record) + " --offset " + std::to_string(offset) +
+					" --key " + type + (desc ? " --desc" : "") + (inPlace ? " --in-place " : " -o " + outPath + " ") + inPath + " > /dev/null";
+				bool ok = writeFile(inPath, data) && system(cmd.c_str()) == 0 && readFile(inPlace ? inPath : outPath) == expected;
+				if (!ok)
+				{
+					std::cout << "    " << type << (desc ? " --desc" : "") << (inPlace ? " --in-place" : " -o") << " failed!\n";
+					good = false;
+				}
+			}
+		}
+	}
+
+	// -o naming the input has to be refused, and leave the input alone
+	std::vector<unsigned char> data(numRecords * record, 7);
+	std::string cmd = std::string(sortfilePath) + " --record 32 --offset 0 --key u32 -o " + inPath + " " + inPath + " 2> /dev/null";
+	if (!writeFile(inPath, data) || system(cmd.c_str()) == 0 || readFile(inPath) != data)
+	{
+		std::cout << "    -o naming the input wasn't refused!\n";
+		good = false;
+	}
+
+	remove(inPath.c_str());
+	remove(outPath.c_str());
+	rmdir(dir);
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
+#endif
+
+// rank() with each Ties option against ranks worked out from a std::sort'ed copy.
+bool testRank(size_t testSize, int testSeed)
+{
+	srand(testSeed);
+	bool good = true;
+
+	std::cout << "size = " << testSize << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+
+	std::vector<int> ints(testSize);
+	std::vector<float> floats(testSize);
+	std::vector<std::string> strs(testSize);
+	for (size_t i = 0; i < testSize; i++)
+	{
+		ints[i] = (rand() % 2000) - 1000;
+		floats[i] = (float)((rand() % 2000) - 1000) / 8.0f;
+		int len = rand() % 4;
+		for (int si = 0; si < len; si++) strs[i] += (char)('a' + rand() % 4);
+	}
+
+	auto check = [&](const char* name, auto& rad, auto& data)
+	{
+		typedef typename std::decay<decltype(data)>::type::value_type V;
+		typedef typename std::decay<decltype(rad)>::type S;
+		std::vector<V> sorted = data;
+		std::sort(sorted.begin(), sorted.end());
+		std::vector<V> distinct = sorted;
+		distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+
+		std::vector<uint32_t> ord(testSize), mn(testSize), dense(testSize);
+		rad.rank(data.data(), ord.data(), testSize, S::Ties::Ordinal, true);
+		rad.rank(data.data(), mn.data(), testSize, S::Ties::Min, true);
+		rad.rank(data.data(), dense.data(), testSize, S::Ties::Dense);
+		std::vector<size_t> seen(testSize, testSize), viewed(testSize);
+		rad.view(data.data(), viewed.data(), testSize);
+		for (size_t i = 0; i < testSize; i++)
+		{
+			size_t expMin = std::lower_bound(sorted.begin(), sorted.end(), data[i]) - sorted.begin();
+			size_t expDense = std::lower_bound(distinct.begin(), distinct.end(), data[i]) - distinct.begin();
+			// Ordinal: a permutation, sorted by key, and exactly the inverse of view(), ties included
+			bool ordOk = ord[i] < testSize && seen[ord[i]] == testSize && sorted[ord[i]] == data[i] && viewed[ord[i]] == i;
+			if (ordOk) seen[ord[i]] = i;
+			if (!ordOk || mn[i] != expMin || dense[i] != expDense)
+			{
+				std::cout << "    " << name << " rank() failed at " << i << "!\n";
+				good = false;
+				return;
+			}
+		}
+	};
+	IntSorter radInt;
+	FloatSorter radFloat;
+	StringSorter radStr;
+	check("int", radInt, ints);
+	check("float", radFloat, floats);
+	check("string", radStr, strs);
+
+	// view() and sort() reverse equal negative floats, so Ordinal has to as well
+	if (testSize >= 4)
+	{
+		std::vector<float> dups(testSize);
+		for (size_t i = 0; i < testSize; i++) dups[i] = (i % 2) ? -2.5f : 1.5f;
+		std::vector<uint32_t> ord(testSize);
+		radFloat.rank(dups.data(), ord.data(), testSize);
+		size_t numNeg = testSize / 2;
+		if (ord[1] != numNeg - 1 || ord[3] != numNeg - 2 || ord[0] != numNeg || ord[2] != numNeg + 1)
+		{
+			std::cout << "    Ordinal ranks of equal negative floats don't match sort()!\n";
+			good = false;
+		}
+	}
+
+	std::vector<unsigned char> tooNarrow(testSize);
+	bool threw = false;
+	try { radInt.rank(ints.data(), tooNarrow.data(), testSize); }
+	catch (std::length_error&) { threw = true; }
+	if (!threw && testSize > 256) { std::cout << "    rank() into unsigned char should have thrown!\n"; good = false; }
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
+
+// A record big enough for sort() to go through tags, with a payload that isn't trivially copyable.
+// name says where the record started, so the tag path has to give exactly sortRange()'s order, ties included.
+struct BigRecord
+{
+	float key;
+	std::string name;
+	char pad[112];
+};
+struct IndexBigRecord
+{
+	IndexFloat ind;
+	inline unsigned char operator()(const BigRecord& r, int byte) { return ind(r.key, byte); }
+};
+struct GetSizeBigRecord { inline int operator()(const BigRecord& /*r*/) { return sizeof(float); } };
+
+bool testIndirect(size_t testSize, int testSeed)
+{
+	srand(testSeed);
+	bool good = true;
+
+	std::cout << "size = " << testSize << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+
+	std::vector<BigRecord> tagged(testSize);
+	for (size_t i = 0; i < testSize; i++)
+	{
+		tagged[i].key = (float)((rand() % 2000) - 1000) / 4.0f;
+		tagged[i].name = "record " + std::to_string(i);
+	}
+	std::vector<BigRecord> direct = tagged;
+
+	Sorter<BigRecord, IndexBigRecord, GetSizeBigRecord> rad(-1.0);
+	rad.sort(tagged.data(), testSize);
+	Tuning t = rad.getTuning();
+	t.indirectBytes = 0;
+	rad.setTuning(t);
+	rad.sort(direct.data(), testSize);
+
+	for (size_t i = 0; i < testSize; i++)
+	{
+		if (tagged[i].key != direct[i].key || tagged[i].name != direct[i].name || (i && tagged[i].key < tagged[i - 1].key))
+		{
+			std::cout << "    Tags and direct sort differ at " << i << "!\n";
+			good = false;
+			break;
+		}
+	}
+
+	// With a pool, big arrays skip the tags and take the pool's passes; same result
+	std::vector<BigRecord> pooled(testSize);
+	for (size_t i = 0; i < testSize; i++) { pooled[i].key = direct[(i * 7919) % testSize].key; pooled[i].name = direct[(i * 7919) % testSize].name; }
+	std::vector<BigRecord> single = pooled;
+	Sorter<BigRecord, IndexBigRecord, GetSizeBigRecord> radPool(-1.0);
+	radPool.useThreads(4);
+	radPool.setParallelThreshold(1000);
+	radPool.sort(pooled.data(), testSize);
+	Sorter<BigRecord, IndexBigRecord, GetSizeBigRecord> radSingle(-1.0);
+	radSingle.sort(single.data(), testSize);
+	for (size_t i = 0; i < testSize; i++)
+	{
+		if (pooled[i].key != single[i].key || pooled[i].name != single[i].name)
+		{
+			std::cout << "    Pool and tag sort differ at " << i << "!\n";
+			good = false;
+			break;
+		}
+	}
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
+
+// partition() has to put every key in a partition no smaller than the ones before it, keep input order
+// inside each (the payload is the input index), and give the same keys as sort() after sortSegments().
+bool testPartition(size_t testSize, int testSeed, unsigned numThreads)
+{
+	srand(testSeed);
+	bool good = true;
+
+	std::cout << "size = " << testSize << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+
+	std::vector<std::pair<float, size_t>> data(testSize);
+	for (size_t i = 0; i < testSize; i++) data[i] = std::make_pair((float)((rand() % 20000) - 10000) / 8.0f, i);
+
+	FloatPairSorter rad(-1.0);
+	if (numThreads != 1) rad.useThreads(numThreads);
+	const int bitsToTry[] = { 1, 3, 10, 16 };
+	for (int bits : bitsToTry)
+	{
+		size_t numParts = (size_t)1 << bits;
+		std::vector<size_t> offsets(numParts + 1);
+		std::vector<std::pair<float, size_t>> parts = data, into(testSize);
+		rad.partition(parts.data(), testSize, bits, offsets.data());
+		std::vector<std::pair<float, size_t>> moveFrom = data;
+		std::vector<size_t> offsetsInto(numParts + 1);
+		rad.partitionInto(moveFrom.data(), into.data(), testSize, bits, offsetsInto.data());
+		if (offsets != offsetsInto || parts != into || offsets[0] != 0 || offsets[numParts] != testSize)
+		{
+			std::cout << "    partition() and partitionInto() differ for " << bits << " bits!\n";
+			good = false;
+			continue;
+		}
+		float prevMax = -std::numeric_limits<float>::infinity();
+		for (size_t p = 0; p < numParts && good; p++)
+		{
+			float partMax = prevMax;
+			for (size_t i = offsets[p]; i < offsets[p + 1]; i++)
+			{
+				bool inOrder = (i == offsets[p] || parts[i - 1].second < parts[i].second);
+				if (parts[i].first < prevMax || !inOrder)
+				{
+					std::cout << "    Partition " << p << " of " << bits << " bits is wrong at " << i << "!\n";
+					good = false;
+					break;
+				}
+				partMax = std::max(partMax, parts[i].first);
+			}
+			prevMax = partMax;
+		}
+
+		// Payloads too: tiny segments get the insertion sort, which has to order ties like the radix passes
+		std::vector<std::pair<float, size_t>> sorted = data;
+		rad.sort(sorted.data(), testSize);
+		rad.sortSegments(parts.data(), offsets.data(), numParts);
+		if (parts != sorted) { std::cout << "    partition() + sortSegments() isn't sort() for " << bits << " bits!\n"; good = false; }
+	}
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
+
+// sort(vector, spare) must hand back the buffer the result landed in instead of copying it. Strings of up
+// to 3 chars take 3 passes, so the result lands in spare and the vectors swap; ints take 4 and stay put.
+bool testHandoff(size_t testSize, int testSeed, unsigned numThreads)
+{
+	srand(testSeed);
+	bool good = true;
+
+	std::cout << "size = " << testSize << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+
+	StringSorter radStr;
+	IntSorter radInt;
+	if (numThreads != 1) { radStr.useThreads(numThreads); radInt.useThreads(numThreads); }
+	std::vector<std::string> strs, spareStrs;
+	std::vector<int> ints, spareInts;
+	for (int iTest = 0; iTest < 3; iTest++)
+	{
+		strs.assign(testSize, std::string());
+		ints.resize(testSize);
+		for (size_t i = 0; i < testSize; i++)
+		{
+			int len = 1 + rand() % 3;
+			for (int si = 0; si < len; si++) strs[i] += (char)('a' + rand() % 26);
+			ints[i] = (rand() % 2000) - 1000;
+		}
+		std::vector<std::string> expStrs = strs;
+		std::vector<int> expInts = ints;
+		std::sort(expStrs.begin(), expStrs.end());
+		std::sort(expInts.begin(), expInts.end());
+
+		spareStrs.resize(testSize); // after the first round, so the buffers are known
+		const std::string* spareBuf = spareStrs.data();
+		radStr.sort(strs, spareStrs, true);
+		if (strs != expStrs || spareStrs.size() != testSize) { std::cout << "    string sort(vector, spare) failed!\n"; good = false; }
+		else if (testSize >= 32 && strs.data() != spareBuf) { std::cout << "    strings were copied back instead of swapped!\n"; good = false; }
+
+		if (iTest == 2) radInt.sort(ints); // the Sorter's own spare
+		else radInt.sort(ints, spareInts);
+		if (ints != expInts) { std::cout << "    int sort(vector) failed!\n"; good = false; }
+	}
+
+	std::vector<int> a(testSize), b(testSize);
+	for (auto& x : a) x = rand() - RAND_MAX / 2;
+	std::vector<int> exp = a;
+	std::sort(exp.begin(), exp.end());
+	int* result = radInt.sortEither(a.data(), b.data(), testSize);
+	if ((result != a.data() && result != b.data()) || !std::equal(exp.begin(), exp.end(), result)) { std::cout << "    sortEither() failed!\n"; good = false; }
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
+
+// Keys in a narrow range get sorted by their distance from the smallest key: one counting sort pass
+// within 64K, and fewer byte passes beyond that for plain integers. Checked against std::stable_sort(),
+// including the ends of each type's range, where the subtraction could wrap.
+bool testNarrow(size_t testSize, int testSeed)
+{
+	srand(testSeed);
+	bool good = true;
+
+	std::cout << "size = " << testSize << std::endl;
+	std::cout << "seed = " << testSeed << std::endl;
+
+	auto check = [&](const char* name, auto& rad, auto data)
+	{
+		auto expected = data;
+		std::stable_sort(expected.begin(), expected.end(), [](const auto& a, const auto& b) { return a < b; });
+		rad.sort(data.data(), data.size());
+		if (data != expected) { std::cout << "    " << name << " failed!\n"; good = false; }
+	};
+	IntSorter radInt;
+	Sorter<long long> radLong;
+	Sorter<unsigned> radUnsigned;
+	Sorter<unsigned> radUnsignedNeg(-1);
+	std::vector<int> ints(testSize), wide(testSize), low(testSize);
+	std::vector<long long> days(testSize);
+	std::vector<unsigned> high(testSize);
+	for (size_t i = 0; i < testSize; i++)
+	{
+		ints[i] = (rand() % 1999) - 999;
+		wide[i] = (rand() % 2000001) - 1000000;
+		low[i] = std::numeric_limits<int>::min() + rand() % 3000;
+		days[i] = 730000 + rand() % 40000;
+		high[i] = std::numeric_limits<unsigned>::max() - rand() % 50000;
+	}
+	check("int +-999", radInt, ints);
+	check("int +-10^6", radInt, wide);
+	check("int near INT_MIN", radInt, low);
+	check("long long days", radLong, days);
+	check("unsigned near max", radUnsigned, high);
+	check("unsigned near max as signed", radUnsignedNeg, high);
+	std::vector<int> same(testSize, 42);
+	check("all equal", radInt, same);
+
+	// Not plain integers: the keys have to be scattered, and equal keys have to keep their order
+	IntPairSorter radPair(-1);
+	std::vector<std::pair<int, size_t>> pairs(testSize);
+	for (size_t i = 0; i < testSize; i++) pairs[i] = std::make_pair((rand() % 1999) - 999, i);
+	auto expected = pairs;
+	std::stable_sort(expected.begin(), expected.end(), [](const std::pair<int, size_t>& a, const std::pair<int, size_t>& b) { return a.first < b.first; });
+	radPair.sort(pairs.data(), testSize);
+	if (pairs != expected) { std::cout << "    int pairs failed!\n"; good = false; }
+
+	// Short strings of different lengths: packedKey() pads them with 0 bytes, which has to give IndexString's
+	// order, prefixes first. With 3 letters and at most 2 of them the keys are within 64K of each other.
+	StringPairSorter radStr;
+	std::vector<std::pair<std::string, size_t>> strs(testSize);
+	for (size_t i = 0; i < testSize; i++)
+	{
+		int len = rand() % 3;
+		for (int c = 0; c < len; c++) strs[i].first += (char)("a\x7f\xff"[rand() % 3]);
+		strs[i].second = i;
+	}
+	auto expectedStrs = strs;
+	std::stable_sort(expectedStrs.begin(), expectedStrs.end(), [](const std::pair<std::string, size_t>& a, const std::pair<std::string, size_t>& b)
+	{
+		return std::lexicographical_compare(a.first.begin(), a.first.end(), b.first.begin(), b.first.end(),
+			[](char x, char y) { return (unsigned char)x < (unsigned char)y; });
+	});
+	radStr.sort(strs.data(), testSize);
+	if (strs != expectedStrs) { std::cout << "    short strings failed!\n"; good = false; }
+
+	std::cout << "\n=== SUMMARY ===\n";
+	std::cout << (good ? "All good!\n" : "Failed.\n");
+	return good;
+}
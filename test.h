@@ -8,3 +8,23 @@ void clearLine();
 bool testInt(size_t testSize, int numTests, int testSeed, int minValue, int maxValue, bool doPrintData, int numbersPerLine = 10);
 bool testStr(size_t testSize, int numTests, int testSeed, int maxStrLength, bool doPrintData);
 bool testFloat(size_t testSize, int numTests, int testSeed, float minValue, float maxValue, bool doPrintData, int numbersPerLine = 10);
+bool testMoveOnly(size_t testSize, int numTests, int testSeed, int minValue, int maxValue);
+bool testParallel(size_t testSize, int numTests, int testSeed, unsigned numThreads);
+bool testAsync(size_t testSize, int numRequests, int testSeed);
+bool testSegments(size_t numSegments, int testSeed, unsigned numThreads);
+bool testRuns(size_t testSize, int testSeed, unsigned numThreads);
+bool testColumns(size_t testSize, int testSeed, unsigned numThreads);
+bool testView(size_t testSize, int testSeed);
+bool testProfile(size_t sampleSize, int testSeed, unsigned numThreads);
+bool testRank(size_t testSize, int testSeed);
+bool testIndirect(size_t testSize, int testSeed);
+bool testPartition(size_t testSize, int testSeed, unsigned numThreads);
+bool testHandoff(size_t testSize, int testSeed, unsigned numThreads);
+bool testNarrow(size_t testSize, int testSeed);
+#ifdef RADIX_SORT_PERF_COUNTERS
+bool testPerfCounters(size_t testSize, int testSeed);
+#endif
+#ifdef __linux__
+bool testDistributed(size_t perRank, int numRanks, int testSeed);
+bool testSortFile(const char* sortfilePath, size_t numRecords, int testSeed);
+#endif